@@ -1,105 +1,238 @@
 #include "filesystem.h"
 #include <stdio.h>
 #include "flash_ops.h"
+#include "fs_sync.h"
 #include <string.h>
+#include <stddef.h>
+
+// Concurrency model: every mutation holds fs_writer, so there is exactly one writer at a time.
+// Readers (fs_list, fs_open, fs_stat, fs_read_extents) never take it. They copy what they need
+// inside an fs_dir_seq read section and retry if the writer changed the directory meanwhile.
+// The writer only holds fs_dir_seq odd for short RAM updates (with interrupts masked on its
+// core) and does all flash work outside it, so listing and opening never wait on an erase.
+// fs_chain_seq versions the cluster chains: fs_delete moves it before unlinking a file and
+// again once its clusters are free, so a reader holding a stale entry cannot follow a chain
+// into clusters that were reused.
+// fs_sector_seq versions the flash itself: every sector rewrite (sector_write) holds the
+// sector's counter odd from the erase until the new data is programmed. A sector holds four
+// clusters, usually from different files, so rewriting it to add or free one cluster leaves
+// its neighbours blank for the length of the erase even though their files never changed.
+// fs_read_extents waits in fs_seq_read_begin while the counter of the sector it is about to
+// read is odd, and retries if it moved, so a reader stalls or retries for at most one sector
+// erase plus program per rewrite. On the board the reading core is parked by
+// flash_safe_execute for the same window regardless.
+// A reader checks both counters after each cluster before trusting what it read.
+//
+// Memory: all state lives in an FS_STATE. A normal build keeps one statically with a single
+// cache slot; an FS_STATIC_MEMORY build has no filesystem RAM of its own and carves the state,
+// the FATable and the cache out of the arena given to fs_mount_arena. Nothing calls malloc
+// except fs_read, which FS_STATIC_MEMORY leaves out. No function keeps a sector buffer on
+// the stack: writers go through the cache, readers read the flash in place via flash_map.
+#ifdef FS_STATIC_MEMORY
+_Static_assert(FS_ARENA_SIZE(FS_CACHE_SLOTS) <= FS_RAM_BUDGET, "filesystem arena exceeds FS_RAM_BUDGET");
+static FS_STATE *fs = NULL;               // Set by fs_mount_arena.
+#else
+static SECTOR_BUFFER fs_default_cache[1];
+static FS_STATE fs_default_state = { .fat = NULL, .cache = fs_default_cache, .cache_slots = 1 };
+static FS_STATE *fs = &fs_default_state;
+#endif
+static fs_seqlock_t fs_dir_seq;           // Versions the FATable entries, free_count and time indexes.
+static fs_seqlock_t fs_chain_seq;         // Versions the cluster chains in flash.
+static fs_seqlock_t fs_sector_seq[FS_SECTOR_SEQS];  // Erase windows, indexed by sector_seq().
+FS_MUTEX_DEFINE(fs_writer);               // Single writer lock.
+
+// Opens a short directory update. Nothing slow (flash, printf) may happen before dir_write_end.
+static uint32_t dir_write_begin(void) {
+    uint32_t irq = fs_irq_save();
+    fs_seq_write_begin(&fs_dir_seq);
+    return irq;
+}
 
-// Function to check if a specific cluster is free
-int is_cluster_free(uint32_t cluster_id) {
-    int clusters_per_sector = SECTOR_SIZE / sizeof(CLUSTER);
-    int sector_num = cluster_id / clusters_per_sector;
-    int cluster_index = cluster_id % clusters_per_sector;
+static void dir_write_end(uint32_t irq) {
+    fs_seq_write_end(&fs_dir_seq);
+    fs_irq_restore(irq);
+}
+
+// Returns the mounted FATable, or NULL.
+static FATable *mounted_fat(void) {
+    return fs != NULL ? fs->fat : NULL;
+}
+
+// Maps cluster_id straight out of flash; the data area is one contiguous mapping.
+static const CLUSTER *cluster_map(uint16_t cluster_id) {
+    const uint8_t *data = flash_map(DATA_SECTOR_OFFSET(0));
+    return data != NULL ? (const CLUSTER *)data + cluster_id : NULL;
+}
+
+// Allocator bitmap, writer only.
+static bool map_is_free(uint32_t cluster_id) {
+    return fs->free_map[cluster_id / 32] & (1u << (cluster_id % 32));
+}
+
+static void map_set(uint32_t cluster_id, bool free) {
+    if (free) {
+        fs->free_map[cluster_id / 32] |= 1u << (cluster_id % 32);
+    } else {
+        fs->free_map[cluster_id / 32] &= ~(1u << (cluster_id % 32));
+    }
+}
+
+// Counter covering a volume sector. Sectors share counters, which only costs the odd
+// needless retry.
+static fs_seqlock_t *sector_seq(uint32_t sector) {
+    return &fs_sector_seq[sector % FS_SECTOR_SEQS];
+}
+
+// Rewrites one volume sector. Every flash write in the filesystem goes through here so that
+// fs_sector_seq covers the erase-then-program window.
+static void sector_write(uint32_t sector, const uint8_t *data) {
+    uint32_t irq = fs_irq_save();  // An ISR reading on this core would wait on the odd count forever.
+    fs_seq_write_begin(sector_seq(sector));
+    flash_write_safe(sector * SECTOR_SIZE, data);
+    fs_seq_write_end(sector_seq(sector));
+    fs_irq_restore(irq);
+}
 
-    SECTOR_BUFFER sb;
-    if (sb.buffer == NULL) {
-        printf("Failed to allocate memory for sector buffer.\n");
-        return -1; // Memory allocation failed
+// Writes a cache slot back to flash if it holds changes.
+static void cache_write_back(SECTOR_BUFFER *sb) {
+    if (sb->dirty) {
+        sector_write(sb->sector, sb->buffer);
+        sb->dirty = false;
     }
+}
 
-    // Load the sector containing the cluster
-    flash_read_safe(sector_num, sb.buffer);
+// Writes back every dirty slot. Writers call this before publishing, since readers only
+// ever see flash.
+static void cache_flush(void) {
+    for (int i = 0; i < fs->cache_slots; i++) {
+        cache_write_back(&fs->cache[i]);
+    }
+}
 
-    // Cast the buffer to an array of CLUSTER
-    CLUSTER* clusters = (CLUSTER*) sb.buffer;
+// Empties the cache without writing anything back, after the sectors were rewritten directly.
+static void cache_invalidate(void) {
+    for (int i = 0; i < fs->cache_slots; i++) {
+        fs->cache[i].sector = -1;
+        fs->cache[i].dirty = false;
+    }
+}
 
-    // Check if the specific cluster is free
-    int is_free = (clusters[cluster_index].next_cluster == CLUSTER_FREE);
+// Evicts the next slot in turn and hands it out as scratch space holding no sector.
+static SECTOR_BUFFER *cache_take(void) {
+    SECTOR_BUFFER *sb = &fs->cache[fs->cache_next];
+    fs->cache_next = (fs->cache_next + 1) % fs->cache_slots;
+    cache_write_back(sb);
+    sb->sector = -1;
+    return sb;
+}
 
-    // Cleanup
+// Returns the slot holding the given volume sector, reading it from flash on a miss.
+static SECTOR_BUFFER *cache_get(uint32_t sector) {
+    for (int i = 0; i < fs->cache_slots; i++) {
+        if (fs->cache[i].sector == sector) {
+            return &fs->cache[i];
+        }
+    }
 
-    return is_free;
+    SECTOR_BUFFER *sb = cache_take();
+    flash_read_safe(sector * SECTOR_SIZE, sb->buffer);
+    sb->sector = sector;
+    return sb;
+}
+
+// Function to check if a specific cluster is free
+int is_cluster_free(uint32_t cluster_id) {
+    if (cluster_id >= MAX_CLUSTERS) {
+        return 0; // Past the end of the data area
+    }
+
+    // Once mounted the allocator bitmap answers without touching flash.
+    if (mounted_fat() != NULL) {
+        return map_is_free(cluster_id);
+    }
+
+    // Otherwise read the cluster header in place.
+    const CLUSTER *cluster = cluster_map(cluster_id);
+    if (cluster == NULL) {
+        return -1;
+    }
+    return cluster->next_cluster == CLUSTER_FREE;
 }
 
 void fs_init(){
-    uint8_t sector_buffer[SECTOR_SIZE];  // Temporary buffer for a whole sector
+    if (fs == NULL) {
+        printf("Error: fs_mount_arena must be called before fs_init.\n");
+        return;
+    }
+
+    fs_mutex_lock(&fs_writer);
+    SECTOR_BUFFER *sb = cache_take();  // Temporary buffer for a whole sector
     int clusters_per_sector = SECTOR_SIZE / CLUSTER_SIZE;
-    // Initialize each sector
-    for (int sector_num = 0; sector_num < MAX_SECTORS; sector_num++) {
-        CLUSTER* clusters = (CLUSTER*)sector_buffer;
+    CLUSTER* clusters = (CLUSTER*)sb->buffer;
 
-        // Initialize all clusters in this sector
-        for (int i = 0; i < clusters_per_sector; i++) {
-            memset(clusters[i].buffer, 0, CLUSTER_DATA_SIZE);  // Set cluster data to zeros
-            clusters[i].next_cluster = CLUSTER_FREE;  // Indicate no further cluster
-        }
+    // Every data sector is the same: all clusters zeroed and free.
+    for (int i = 0; i < clusters_per_sector; i++) {
+        memset(clusters[i].buffer, 0, CLUSTER_DATA_SIZE);  // Set cluster data to zeros
+        clusters[i].next_cluster = CLUSTER_FREE;  // Indicate no further cluster
+    }
 
+    // Initialize each sector
+    for (int sector_num = 0; sector_num < MAX_CLUSTERS / clusters_per_sector; sector_num++) {
         // Write the initialized sector back to flash
-        flash_write_safe(sector_num, sector_buffer);
+        sector_write(DATA_SECTOR(sector_num), sb->buffer);
         printf("Debug: Initialized sector %d with empty clusters.\n", sector_num);
     }
+
+    cache_invalidate();
+    fs_mutex_unlock(&fs_writer);
 }
 
 
 
 // Initializes the File Allocation Table (FAT).
+// Builds the empty table one sector at a time rather than holding a whole FATable on the stack.
 void fat_init() {
     // Output message indicating the initialization of the FAT.
     printf("Initializing File Allocation Table...\n");
 
-    // Define and initialize a FATable structure.
-    FATable fat;
-    fat.free_count = MAX_CLUSTERS;  // Set the number of free clusters to the maximum allowed.
-    printf("Free clusters calculated: %u\n", fat.free_count);  // Print the number of free clusters.
+    if (fs == NULL) {
+        printf("Error: fs_mount_arena must be called before fat_init.\n");
+        return;
+    }
+
+    // An empty table is all zeros (every filename empty) apart from free_count.
+    uint32_t free_count = MAX_CLUSTERS;  // Set the number of free clusters to the maximum allowed.
+    size_t free_count_offset = offsetof(FATable, free_count);
+    printf("Free clusters calculated: %u\n", free_count);  // Print the number of free clusters.
 
-    // Create a pointer to the FATable and calculate its total size.
-    uint8_t* data = (uint8_t*)&fat;
     size_t total_size = sizeof(FATable);
     size_t written = 0;  // Keep track of the number of bytes written.
     int sector_num = 0;  // Initialize sector number for tracking during the write process.
 
+    fs_mutex_lock(&fs_writer);
+    SECTOR_BUFFER *sb = cache_take();
+
     // Loop until all the data of the FATable is written.
     while (written < total_size) {
         printf("\nInit sector: %d\n", sector_num);  // Output message indicating the current sector being initialized.
-        
-        // Initialize a sector buffer to temporarily hold data before writing to storage.
-        SECTOR_BUFFER sb = { .sector = -1, .dirty = false };
-        memset(sb.buffer, 0 ,SECTOR_SIZE);  // Clear the buffer to make sure it is clean before use.
-        
-        if (sb.buffer == NULL) {
-            printf("Failed to allocate memory for sector buffer.\n");
-            break;  // Exit the loop if memory allocation failed.
-        }
-
-        // Calculate the number of bytes to write in the current loop iteration.
-        size_t bytes_to_write = total_size - written > SECTOR_SIZE ? SECTOR_SIZE : total_size - written;
-        memcpy(sb.buffer, data + written, bytes_to_write);  // Copy the calculated bytes from data to the buffer.
-        sb.dirty = true;  // Mark the buffer as dirty indicating that it has new data to be written.
 
-        // Write back the initialized sector to storage if the buffer is dirty.
-        if (sb.dirty) {
-            flash_write_safe(sector_num, sb.buffer);  // Safe write operation to ensure data integrity.
-            sb.dirty = false;  // Mark the buffer as not dirty after the data is written.
-            printf("FATable data written to sector %d successfully.\n", sector_num);  // Confirm successful write operation.
+        memset(sb->buffer, 0, SECTOR_SIZE);  // Clear the buffer to make sure it is clean before use.
+        if (free_count_offset >= written && free_count_offset < written + SECTOR_SIZE) {
+            memcpy(sb->buffer + (free_count_offset - written), &free_count, sizeof(free_count));
         }
 
-        written += bytes_to_write;  // Update the count of written bytes.
+        sector_write(sector_num, sb->buffer);  // Safe write operation to ensure data integrity.
+        printf("FATable data written to sector %d successfully.\n", sector_num);  // Confirm successful write operation.
+
+        written += SECTOR_SIZE;  // Update the count of written bytes.
         sector_num++;  // Move to the next sector.
     }
+
+    fs_mutex_unlock(&fs_writer);
 }
 
 void fat_read(FATable* fat) {
     printf("\nreading FATable structure\n");
-    SECTOR_BUFFER sb;
-    sb.sector = -1;  // Initialize sector to an invalid value
 
     int total_size = sizeof(FATable);
     int bytes_read = 0;
@@ -108,9 +241,11 @@ void fat_read(FATable* fat) {
     while (bytes_read < total_size) {
         printf("\nRead loop: Reading sector %d\n", sector_num);
 
-        // Load the sector
-        flash_read_safe(sector_num, sb.buffer);
-        sb.sector = sector_num;
+        // Map the sector, the table is copied straight out of flash
+        const uint8_t *sector = flash_map(sector_num * SECTOR_SIZE);
+        if (sector == NULL) {
+            return;
+        }
 
         // Calculate how much to copy
         int copy_size = total_size - bytes_read;
@@ -118,8 +253,8 @@ void fat_read(FATable* fat) {
             copy_size = SECTOR_SIZE;
         }
 
-        // Copy the data from the sector buffer to the FATable structure
-        memcpy(((uint8_t*)fat) + bytes_read, sb.buffer, copy_size);
+        // Copy the data from flash to the FATable structure
+        memcpy(((uint8_t*)fat) + bytes_read, sector, copy_size);
         bytes_read += copy_size;
         sector_num++;  // Move to the next sector
     }
@@ -131,9 +266,11 @@ void fat_read(FATable* fat) {
 // Writes the updated File Allocation Table (FAT) to storage.
 void fat_write(const FATable* fat) {
     printf("\nWriting FATable structure\n");  // Notify start of write process
-
-    SECTOR_BUFFER sb;
-    sb.sector = -1;  // Initialize sector to an invalid value for safety
+    if (fs == NULL) {
+        printf("Error: Nothing mounted.\n");
+        return;
+    }
+    fs_mutex_lock(&fs_writer);  // Keep writers from changing the table while it is copied out.
 
     int total_size = sizeof(FATable);  // Calculate the total size of the FATable
     int bytes_written = 0;
@@ -142,33 +279,281 @@ void fat_write(const FATable* fat) {
     while (bytes_written < total_size) {
         printf("\nWrite loop: Writing sector %d\n", sector_num);  // Notify which sector is being written
 
-        // Clear the sector buffer to prepare for new data
-        memset(sb.buffer, 0, SECTOR_SIZE);
-        
         // Determine the number of bytes to write in this iteration
         int write_size = total_size - bytes_written;
-        if (write_size > SECTOR_SIZE) {
+        if (write_size >= SECTOR_SIZE) {
+            // Whole sectors go to flash straight from the table
+            sector_write(sector_num, ((const uint8_t*)fat) + bytes_written);
             write_size = SECTOR_SIZE;
+        } else {
+            // The tail is padded out with zeros in a cache slot
+            SECTOR_BUFFER *sb = cache_take();
+            memset(sb->buffer, 0, SECTOR_SIZE);
+            memcpy(sb->buffer, ((const uint8_t*)fat) + bytes_written, write_size);
+            sector_write(sector_num, sb->buffer);
         }
+        printf("FATable data written to sector %d successfully.\n", sector_num);  // Confirm successful write operation
 
-        // Copy the necessary data from the FATable to the sector buffer
-        memcpy(sb.buffer, ((uint8_t*)fat) + bytes_written, write_size);
+        bytes_written += write_size;  // Update the count of bytes written
+        sector_num++;  // Increment to the next sector
+    }
 
-        // Mark the buffer as dirty since it now contains new data
-        sb.dirty = true;
+    fs_mutex_unlock(&fs_writer);
+    printf("\nFinished writing FATable structure\n");  // Notify end of write process
+}
+
+// Packs a datetime into a 32-bit key that sorts in chronological order.
+// Layout from the top bit down: year since 2000 (6), month (4), day (5), hour (5), minute (6), second (6).
+// Years outside 2000-2063 are clamped, unset (negative) fields count as zero.
+uint32_t fs_time_key(const datetime_t *t) {
+    int year = t->year - 2000;
+    if (year < 0) year = 0;
+    if (year > 63) year = 63;
+
+    return ((uint32_t)year << 26) |
+           ((uint32_t)(t->month < 0 ? 0 : t->month & 0x0F) << 22) |
+           ((uint32_t)(t->day < 0 ? 0 : t->day & 0x1F) << 17) |
+           ((uint32_t)(t->hour < 0 ? 0 : t->hour & 0x1F) << 12) |
+           ((uint32_t)(t->min < 0 ? 0 : t->min & 0x3F) << 6) |
+           (uint32_t)(t->sec < 0 ? 0 : t->sec & 0x3F);
+}
 
-        // Write the buffer to storage if it is marked dirty
-        if (sb.dirty) {
-            flash_write_safe(sector_num, sb.buffer);  // Safe write operation to ensure data integrity
-            sb.dirty = false;  // Reset the dirty flag after writing
-            printf("FATable data written to sector %d successfully.\n", sector_num);  // Confirm successful write operation
+// Returns the first position in the index whose key is >= key.
+static int index_lower_bound(const FS_TIME_INDEX *idx, uint32_t key) {
+    int lo = 0, hi = idx->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (idx->key[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
+    return lo;
+}
 
-        bytes_written += write_size;  // Update the count of bytes written
-        sector_num++;  // Increment to the next sector
+// Inserts slot after any existing entries with the same key so equal times keep creation order.
+static void index_insert(FS_TIME_INDEX *idx, uint32_t key, uint8_t slot) {
+    int pos = index_lower_bound(idx, key);
+    while (pos < idx->count && idx->key[pos] == key) {
+        pos++;
     }
+    memmove(&idx->key[pos + 1], &idx->key[pos], (idx->count - pos) * sizeof(idx->key[0]));
+    memmove(&idx->slot[pos + 1], &idx->slot[pos], (idx->count - pos) * sizeof(idx->slot[0]));
+    idx->key[pos] = key;
+    idx->slot[pos] = slot;
+    idx->count++;
+}
 
-    printf("\nFinished writing FATable structure\n");  // Notify end of write process
+// Removes slot from the index; key must be the one it was inserted with.
+static void index_remove(FS_TIME_INDEX *idx, uint32_t key, uint8_t slot) {
+    int pos = index_lower_bound(idx, key);
+    while (pos < idx->count && idx->key[pos] == key && idx->slot[pos] != slot) {
+        pos++;
+    }
+    if (pos >= idx->count || idx->key[pos] != key) {
+        return;  // Not indexed.
+    }
+    memmove(&idx->key[pos], &idx->key[pos + 1], (idx->count - pos - 1) * sizeof(idx->key[0]));
+    memmove(&idx->slot[pos], &idx->slot[pos + 1], (idx->count - pos - 1) * sizeof(idx->slot[0]));
+    idx->count--;
+}
+
+// Sets the last modified time of a mounted file to now and moves it in the modify index.
+// Call inside a dir_write_begin/dir_write_end section.
+static void fs_index_touch(FS_FILE *file) {
+    datetime_t t;
+    rtc_get_datetime(&t);
+
+    FATable *fat = mounted_fat();
+    if (fat == NULL || file < fat->entries || file >= fat->entries + MAX_FILES) {
+        file->last_mod_datetime = t;  // Not part of the mounted table, nothing to reindex.
+        return;
+    }
+
+    uint8_t slot = file - fat->entries;
+    index_remove(&fs->index[FS_TIME_MODIFY], fs_time_key(&file->last_mod_datetime), slot);
+    file->last_mod_datetime = t;
+    index_insert(&fs->index[FS_TIME_MODIFY], fs_time_key(&t), slot);
+}
+
+// Builds the time indexes and the allocator bitmap for fs->fat. Holds the writer lock.
+static void fs_mount_locked(void) {
+    uint32_t irq = dir_write_begin();
+    memset(fs->index, 0, sizeof(fs->index));
+
+    for (int i = 0; i < MAX_FILES; i++) {
+        FS_FILE *file = &fs->fat->entries[i];
+        if (file->filename[0] == '\0') {
+            continue;  // Free entry.
+        }
+        index_insert(&fs->index[FS_TIME_CREATE], fs_time_key(&file->create_datetime), i);
+        index_insert(&fs->index[FS_TIME_MODIFY], fs_time_key(&file->last_mod_datetime), i);
+    }
+    dir_write_end(irq);
+
+    // The bitmap mirrors the cluster headers in flash.
+    const CLUSTER *clusters = cluster_map(0);
+    for (uint32_t cluster_id = 0; cluster_id < MAX_CLUSTERS; cluster_id++) {
+        map_set(cluster_id, clusters != NULL && clusters[cluster_id].next_cluster == CLUSTER_FREE);
+    }
+    cache_invalidate();
+}
+
+#ifndef FS_STATIC_MEMORY
+// Binds an in-RAM FATable (usually filled by fat_read) and builds its time indexes.
+// Must be called before fat_fs_new, fs_delete or fs_list, and before the other core starts
+// using the filesystem.
+void fs_mount(FATable *fat) {
+    fs_mutex_lock(&fs_writer);
+    fs->fat = fat;
+    fs_mount_locked();
+    fs_mutex_unlock(&fs_writer);
+}
+#endif
+
+// Mounts the filesystem with all of its RAM taken from one caller-provided arena: the
+// FS_STATE, the FATable (read from flash here) and as many sector cache slots as fit.
+// Size the arena with FS_ARENA_SIZE(cache_slots); it must be 8-byte aligned and outlive
+// the mount. Calling it again remounts, e.g. after fs_init and fat_init formatted the flash.
+// Parameters:
+//   arena: Memory for the filesystem.
+//   size: Size of the arena in bytes.
+// Returns the mounted FATable, or NULL if the arena is too small or misaligned.
+FATable* fs_mount_arena(void *arena, size_t size) {
+    if (arena == NULL || ((uintptr_t)arena & 7) != 0 || size < FS_ARENA_SIZE(1)) {
+        printf("Error: Arena must be 8-byte aligned and at least %u bytes.\n", (unsigned)FS_ARENA_SIZE(1));
+        return NULL;
+    }
+
+    size_t slots = (size - FS_ARENA_SIZE(0)) / sizeof(SECTOR_BUFFER);
+    if (slots > 255) {
+        slots = 255;
+    }
+
+    fs_mutex_lock(&fs_writer);
+    FS_STATE *state = (FS_STATE *)arena;
+    state->fat = (FATable *)((uint8_t *)arena + sizeof(FS_STATE));
+    state->cache = (SECTOR_BUFFER *)((uint8_t *)state->fat + sizeof(FATable));
+    state->cache_slots = slots;
+    state->cache_next = 0;
+    fat_read(state->fat);
+
+    fs = state;
+    fs_mount_locked();
+    fs_mutex_unlock(&fs_writer);
+    return state->fat;
+}
+
+// True if file falls in the filter's time range and has its extension and attribute bits.
+static bool filter_matches(const FS_FILTER *filter, const FS_FILE *file) {
+    uint32_t key = fs_time_key(filter->time_field == FS_TIME_MODIFY ? &file->last_mod_datetime : &file->create_datetime);
+    if (key < filter->from || key > filter->to) {
+        return false;
+    }
+    if (filter->extension != NULL && strncmp(filter->extension, file->extension, MAX_EXTENSION_LENGTH) != 0) {
+        return false;
+    }
+    return (file->attributes & filter->attr_mask) == filter->attr_value;
+}
+
+// Lists the mounted files whose create or modify time falls in [filter->from, filter->to],
+// in time order, also matching the extension and attribute bits when set.
+// The time range is found by binary search, so the cost is O(log n) plus the entries in range.
+// Parameters:
+//   filter: Query to apply, or NULL to list every file by creation time.
+//   callback: Called for each match; returning false stops the listing.
+//   ctx: Passed through to the callback.
+// Returns the number of matches passed to the callback, or -1 if nothing is mounted.
+int fs_list(const FS_FILTER *filter, fs_list_callback callback, void *ctx) {
+    static const FS_FILTER all = { .time_field = FS_TIME_CREATE, .from = 0, .to = FS_TIME_MAX };
+    FATable *fat = mounted_fat();
+    if (fat == NULL) {
+        printf("Error: No FATable mounted.\n");
+        return -1;
+    }
+    if (filter == NULL) {
+        filter = &all;
+    }
+
+    const FS_TIME_INDEX *idx = &fs->index[filter->time_field == FS_TIME_MODIFY ? FS_TIME_MODIFY : FS_TIME_CREATE];
+    uint8_t slots[MAX_FILES];
+    int found;
+    uint32_t seq;
+
+    // Collect the matching slots from a consistent view of the index.
+    do {
+        seq = fs_seq_read_begin(&fs_dir_seq);
+        found = 0;
+        int count = idx->count <= MAX_FILES ? idx->count : MAX_FILES;
+
+        for (int pos = index_lower_bound(idx, filter->from); pos < count && idx->key[pos] <= filter->to; pos++) {
+            uint8_t slot = idx->slot[pos];
+            if (filter_matches(filter, &fat->entries[slot < MAX_FILES ? slot : 0])) {
+                slots[found++] = slot;
+            }
+        }
+    } while (fs_seq_read_retry(&fs_dir_seq, seq));
+
+    // Hand each one to the callback as a private copy. The writer may have deleted, reused or
+    // touched the slot since it was collected, so the copy is checked against the filter again.
+    int matched = 0;
+    for (int i = 0; i < found; i++) {
+        FS_FILE snapshot;
+        if (fs_stat(&fat->entries[slots[i]], &snapshot) != 0 || !filter_matches(filter, &snapshot)) {
+            continue;
+        }
+
+        matched++;
+        if (!callback(&snapshot, ctx)) {
+            break;
+        }
+    }
+    return matched;
+}
+
+// Copies a directory entry as it stood at one instant, safe against a writer on the other core.
+// Parameters:
+//   file: Entry in the mounted FATable.
+//   out: Receives the copy.
+// Returns 0 on success, or -1 if the entry is free.
+int fs_stat(const FS_FILE *file, FS_FILE *out) {
+    uint32_t seq;
+    do {
+        seq = fs_seq_read_begin(&fs_dir_seq);
+        memcpy(out, file, sizeof(FS_FILE));
+    } while (fs_seq_read_retry(&fs_dir_seq, seq));
+
+    return out->filename[0] == '\0' ? -1 : 0;
+}
+
+static bool ls_print_entry(const FS_FILE *file, void *ctx) {
+    (void)ctx;
+    const datetime_t *c = &file->create_datetime;
+    printf("%04d-%02d-%02d %02d:%02d:%02d %10u  %s.%s\n",
+           c->year, c->month, c->day, c->hour, c->min, c->sec, file->size, file->filename, file->extension);
+    return true;
+}
+
+// Prints every file in the mounted FATable, oldest first.
+void ls_directory() {
+    int count = fs_list(NULL, ls_print_entry, NULL);
+    if (count >= 0) {
+        printf("%d file(s), %u free clusters\n", count, mounted_fat()->free_count);
+    }
+}
+
+// Returns the first free cluster at or after start, or CLUSTER_EOF when the data area is full.
+// Scans the allocator bitmap a word (32 clusters) at a time.
+static uint16_t fs_find_free_cluster(uint16_t start) {
+    for (uint32_t cluster_id = start; cluster_id < MAX_CLUSTERS; ) {
+        uint32_t word = fs->free_map[cluster_id / 32] >> (cluster_id % 32);
+        if (word != 0) {
+            return cluster_id + __builtin_ctz(word);
+        }
+        cluster_id = (cluster_id / 32 + 1) * 32;
+    }
+    return CLUSTER_EOF;
 }
 /**
  * Opens a file with the specified path and mode.
@@ -193,16 +578,19 @@ FS_FILE* fs_open(const char *filename, const char *mode, FATable *fat) {
     // The 'if' condition checks if the mode is "rw".
     if (strcmp(mode, "rw") == 0) {
         // Iterate over all possible file entries in the FAT.
-        for (int i = 0; i < MAX_CLUSTERS; i++) {
+        for (int i = 0; i < MAX_FILES; i++) {
             FS_FILE *file = &fat->entries[i];  // Get a pointer to the file entry in the FAT.
 
-            // Output the filename and size of each file in the FAT for debugging.
-            printf("Filename: %s\n", file->filename);
-            printf("File size: %u bytes\n", file->size);
+            // Compare the name against a consistent view of the entry, a writer may be changing it.
+            bool match;
+            uint32_t seq;
+            do {
+                seq = fs_seq_read_begin(&fs_dir_seq);
+                match = file->filename[0] != '\0' && strncmp(filename, file->filename, MAX_FILENAME_LENGTH) == 0;
+            } while (fs_seq_read_retry(&fs_dir_seq, seq));
 
             // Check if the current file's name matches the requested filename.
-            if (strcmp(filename, file->filename) == 0) {
-                printf("File size: %u\n", file->size); // Print the size of the found file.
+            if (match) {
                 return file;  // Return the pointer to the found file.
             }
         }
@@ -217,8 +605,106 @@ FS_FILE* fs_open(const char *filename, const char *mode, FATable *fat) {
 }
 
 
-FS_FILE* fat_fs_new(FATable *fat){
-    
+// Creates a new, empty file in the first free FATable entry.
+// The file gets its first cluster on the first fs_write.
+// Parameters:
+//   fat: The mounted File Allocation Table.
+//   filename: Name of the new file.
+//   extension: Extension of the new file.
+// Returns the new entry, or NULL if the table is full.
+FS_FILE* fat_fs_new(FATable *fat, const char *filename, const char *extension) {
+    fs_mutex_lock(&fs_writer);
+
+    for (int i = 0; i < MAX_FILES; i++) {
+        FS_FILE *file = &fat->entries[i];
+        if (file->filename[0] != '\0') {
+            continue;  // Entry already used.
+        }
+
+        datetime_t t;
+        rtc_get_datetime(&t);
+
+        uint32_t irq = dir_write_begin();
+        memset(file, 0, sizeof(FS_FILE));
+        strncpy(file->filename, filename, MAX_FILENAME_LENGTH - 1);
+        strncpy(file->extension, extension, MAX_EXTENSION_LENGTH - 1);
+        file->first_cluster = CLUSTER_EOF;  // No data yet.
+        file->create_datetime = t;
+        file->last_access_datetime = t;
+        file->last_mod_datetime = t;
+
+        if (fat == mounted_fat()) {
+            index_insert(&fs->index[FS_TIME_CREATE], fs_time_key(&t), i);
+            index_insert(&fs->index[FS_TIME_MODIFY], fs_time_key(&t), i);
+        }
+        dir_write_end(irq);
+
+        fs_mutex_unlock(&fs_writer);
+        return file;
+    }
+
+    fs_mutex_unlock(&fs_writer);
+    printf("Error: No free file entries.\n");
+    return NULL;
+}
+
+// Deletes a file: frees its cluster chain, returns the clusters to free_count and clears the entry.
+// Parameters:
+//   fat: The mounted File Allocation Table.
+//   file: The entry to delete.
+// Returns 0 on success, or -1 if the file is not part of the table.
+int fs_delete(FATable *fat, FS_FILE *file) {
+    if (fat != mounted_fat() || file == NULL || file < fat->entries || file >= fat->entries + MAX_FILES) {
+        printf("Error: Not a file in this FATable.\n");
+        return -1;
+    }
+
+    fs_mutex_lock(&fs_writer);
+    if (file->filename[0] == '\0') {
+        fs_mutex_unlock(&fs_writer);
+        printf("Error: File already deleted.\n");
+        return -1;
+    }
+
+    int clusters_per_sector = SECTOR_SIZE / CLUSTER_SIZE;
+    uint16_t cluster_id = file->first_cluster;
+    uint32_t freed = 0;
+
+    // Unlink the entry first so new readers cannot find it; readers already walking its
+    // chain see fs_chain_seq move and start again.
+    fs_seq_write_begin(&fs_chain_seq);
+    uint32_t irq = dir_write_begin();
+    uint8_t slot = file - fat->entries;
+    index_remove(&fs->index[FS_TIME_CREATE], fs_time_key(&file->create_datetime), slot);
+    index_remove(&fs->index[FS_TIME_MODIFY], fs_time_key(&file->last_mod_datetime), slot);
+    memset(file, 0, sizeof(FS_FILE));
+    dir_write_end(irq);
+
+    // Walk the chain marking every cluster free, one sector write per touched sector.
+    while (cluster_id < MAX_CLUSTERS && freed < MAX_CLUSTERS) {
+        SECTOR_BUFFER *sb = cache_get(DATA_SECTOR(cluster_id / clusters_per_sector));
+        CLUSTER* cluster = &((CLUSTER*)sb->buffer)[cluster_id % clusters_per_sector];
+        uint16_t next = cluster->next_cluster;
+        cluster->next_cluster = CLUSTER_FREE;
+        sb->dirty = true;
+        map_set(cluster_id, true);
+        freed++;
+
+        if (next == CLUSTER_EOF) {
+            break;
+        }
+        cluster_id = next;
+    }
+
+    cache_flush();
+
+    irq = dir_write_begin();
+    fat->free_count += freed;
+    dir_write_end(irq);
+    fs_seq_write_end(&fs_chain_seq);
+
+    fs_mutex_unlock(&fs_writer);
+    return 0;
 }
 
 /**
@@ -231,10 +717,15 @@ void fs_Close(FS_FILE* file) {
     //set last access time
     datetime_t t;
     rtc_get_datetime(&t);
+
+    fs_mutex_lock(&fs_writer);
+    uint32_t irq = dir_write_begin();
     file->last_access_datetime = t;
 
     // Mark the file as not in use
     file->in_use = false;
+    dir_write_end(irq);
+    fs_mutex_unlock(&fs_writer);
 }
 
 // Edits a file by writing data to its clusters.
@@ -243,156 +734,164 @@ void fs_Close(FS_FILE* file) {
 //   data: Pointer to the data to be written to the file.
 //   size: The size of the data to be written.
 void fs_edit(FS_FILE* file, const uint8_t *data, int size) {
-    uint32_t remaining_size = size;  // Amount of data left to write.
-    uint32_t offset = 0;  // Offset in the data buffer.
-    uint16_t cluster_id = file->first_cluster;  // First cluster of the file.
-    int clusters_per_sector = SECTOR_SIZE / CLUSTER_SIZE;  // Number of clusters in each sector.
-
-    // Buffer to hold the current sector's data.
-    SECTOR_BUFFER sb = { .sector = -1, .dirty = false };
-
-    // Continue until all data is written.
-    while (remaining_size > 0) {
-        int sector_num = cluster_id / clusters_per_sector;  // Calculate sector number.
-        int cluster_num = cluster_id % clusters_per_sector;  // Calculate cluster number within the sector.
-
-        // If the sector in the buffer is not the sector we need, or if it's dirty, update it.
-        if (sb.sector != sector_num) {
-            if (sb.dirty) {
-                flash_write_safe(sb.sector, sb.buffer);  // Write the dirty buffer to flash.
-                sb.dirty = false;  // Clear the dirty flag.
-            }
-            flash_read_safe(sector_num, sb.buffer);  // Read the needed sector into the buffer.
-            sb.sector = sector_num;  // Update the buffer's sector number.
-        }
+    // Same cluster walk as fs_write, errors are reported there.
+    fs_write(file, data, size);
+}
 
-        // Access the cluster within the buffer.
-        CLUSTER* cluster_array = (CLUSTER*)sb.buffer;
-        CLUSTER* cluster = &cluster_array[cluster_num];
 
-        // Check if the cluster is free before writing.
-        if (is_cluster_free(cluster_id)) {
-            uint32_t bytes_to_copy = remaining_size < CLUSTER_DATA_SIZE ? remaining_size : CLUSTER_DATA_SIZE;  // Determine the number of bytes to copy.
-            memcpy(cluster->buffer, data + offset, bytes_to_copy);  // Copy data to the cluster.
-            offset += bytes_to_copy;  // Increment the offset by the number of bytes copied.
-            remaining_size -= bytes_to_copy;  // Decrement the remaining size.
-            sb.dirty = true;  // Mark the sector buffer as dirty.
+/**
+ * Passes the bytes of a file to a callback straight out of the flash mapping, one piece
+ * per cluster, without copying them anywhere first.
+ *
+ * Safe to call while the other core writes: the entry is copied under fs_dir_seq, and
+ * fs_chain_seq and the cluster's fs_sector_seq are checked after every piece and link
+ * followed, so the walk stops as soon as a chain is freed or a sector it read from gets
+ * rewritten. The piece just delivered may then be torn,
+ * so callers that cannot take data back (a stream) must treat FS_READ_CHANGED as "discard
+ * everything delivered by this call".
+ *
+ * @param file     A pointer to the file from which to read.
+ * @param offset   Byte offset in the file to start reading at.
+ * @param len      The maximum number of bytes to read.
+ * @param callback Receives each piece; returning false stops the read.
+ * @param ctx      Passed through to the callback.
+ * @return The number of bytes delivered, -1 if the file is free or its chain is broken,
+ *         or FS_READ_CHANGED if a chain was freed or a sector rewritten during the walk.
+ */
+int fs_read_extents(const FS_FILE* file, uint32_t offset, uint32_t len, fs_extent_callback callback, void *ctx) {
+    // Snapshot what the walk needs, and the chain version it was valid for.
+    uint32_t seq, chain, size;
+    uint16_t cluster_id;
+    bool used;
+    do {
+        seq = fs_seq_read_begin(&fs_dir_seq);
+        chain = fs_seq_peek(&fs_chain_seq);
+        used = file->filename[0] != '\0';
+        size = file->size;
+        cluster_id = file->first_cluster;
+    } while (fs_seq_read_retry(&fs_dir_seq, seq));
+
+    if (!used) {
+        return -1;
+    }
+    if (offset >= size) {
+        return 0;
+    }
+    uint32_t want = len < size - offset ? len : size - offset;
 
-            printf("Debug: Copied %u bytes to cluster %u at offset %u. Remaining size: %u\n", bytes_to_copy, cluster_id, offset, remaining_size);
+    uint32_t skip = offset / CLUSTER_DATA_SIZE;  // Whole clusters before the offset.
+    uint32_t in_cluster = offset % CLUSTER_DATA_SIZE;
+    uint32_t done = 0;
 
-            // If there's more data to write, find the next free cluster.
-            if (remaining_size > 0) {
-                do {
-                    cluster_id++;  // Move to the next cluster ID.
-                } while (!is_cluster_free(cluster_id) && cluster_id < MAX_CLUSTERS);
+    for (uint32_t i = 0; done < want; i++) {
+        if (cluster_id >= MAX_CLUSTERS || i > MAX_CLUSTERS) {
+            // Chain ended early or loops; only corruption if nothing was freed meanwhile.
+            return fs_seq_peek(&fs_chain_seq) == chain ? -1 : FS_READ_CHANGED;
+        }
 
-                // If a free cluster is found, update the cluster linkage.
-                if (is_cluster_free(cluster_id)) {
-                    cluster->next_cluster = cluster_id;  // Set the next cluster in the file's chain.
-                    printf("Debug: Assigned next free cluster ID %u\n", cluster_id);
-                } else {
-                    printf("Error: No free clusters available.\n");
-                    return;  // Return if no free clusters are available.
-                }
-            } else {
-                cluster->next_cluster = CLUSTER_EOF;  // Mark the end of the file's cluster chain.
-            }
-        } else {
-            printf("Error: Cluster %u is not free.\n", cluster_id);
-            return;  // Stop if the current cluster is not free.
+        // Read the cluster in place, no sector buffer needed, once any rewrite of its sector is over.
+        const CLUSTER* cluster = cluster_map(cluster_id);
+        if (cluster == NULL) {
+            return -1;
         }
-    }
+        fs_seqlock_t *erase = sector_seq(DATA_SECTOR(cluster_id / CLUSTERS_PER_SECTOR));
+        uint32_t sector_version = fs_seq_read_begin(erase);
 
-    // Write the last modified sector if it's dirty.
-    if (sb.dirty) {
-        flash_write_safe(sb.sector, sb.buffer);
-    }
+        if (i >= skip) {
+            uint32_t piece = CLUSTER_DATA_SIZE - in_cluster;
+            if (piece > want - done) {
+                piece = want - done;
+            }
+            bool more = callback(cluster->buffer + in_cluster, piece, ctx);
+            done += piece;
+            in_cluster = 0;
+            if (!more) {
+                break;
+            }
+        }
+        cluster_id = cluster->next_cluster;
 
-    // Update the file size if it has increased.
-    if (file->size < size) {
-        file->size = size;
+        // Both the piece and the link came from flash; trust them only if the sector was
+        // not rewritten and no chain freed meanwhile.
+        if (fs_seq_read_retry(erase, sector_version) || fs_seq_peek(&fs_chain_seq) != chain) {
+            return FS_READ_CHANGED;
+        }
     }
 
-    // Update the file's last modified timestamp.
-    datetime_t t;
-    rtc_get_datetime(&t);  // Get the current date and time.
-    file->last_mod_datetime = t;  // Set the last modified datetime of the file.
-
-    return;
+    return fs_seq_peek(&fs_chain_seq) == chain ? (int)done : FS_READ_CHANGED;
 }
 
+static bool copy_extent(const uint8_t *data, uint32_t len, void *ctx) {
+    uint8_t **cursor = ctx;
+    memcpy(*cursor, data, len);
+    *cursor += len;
+    return true;
+}
 
 /**
  * Reads data from the specified file into the provided buffer.
  *
+ * Safe to call while the other core writes: the read starts again if a chain was freed
+ * while it was being walked.
+ *
  * @param file   A pointer to the file from which to read.
  * @param buffer A pointer to the buffer where the read data will be stored.
- * @param size   The maximum number of bytes to read.
- * @return The number of bytes read, or -1 if an error occurred.
+ * @param offset Byte offset in the file to start reading at.
+ * @param len    The maximum number of bytes to read.
+ * @return The number of bytes read, or -1 if the file is free or its chain is broken.
  */
+int fs_read_into(const FS_FILE* file, uint8_t *buffer, uint32_t offset, uint32_t len) {
+    for (;;) {
+        uint8_t *cursor = buffer;
+        int read = fs_read_extents(file, offset, len, copy_extent, &cursor);
+        if (read != FS_READ_CHANGED) {
+            return read;
+        }
+    }
+}
+
+#ifndef FS_STATIC_MEMORY
 // Reads the entire content of a file and returns it as a byte array.
 // Parameters:
 //   file: Pointer to the FS_FILE structure representing the file to read.
 uint8_t* fs_read(FS_FILE* file) {
-    // Allocate memory for the buffer to hold the file's data.
-    uint8_t* buffer = malloc(file->size);
-    if (buffer == NULL) {
-        printf("Memory allocation failed.\n"); // Check for successful memory allocation.
-        return NULL;  // Return NULL if memory allocation fails.
-    }
-    printf("\nreading");  // Debug print to indicate the reading process starts.
-
-    // Initialize a sector buffer for reading data from storage.
-    SECTOR_BUFFER sb;
-    sb.sector = -1;  // Initialize the sector number as -1 to ensure the first read.
-
-    // Calculate the number of clusters per sector based on sector and cluster sizes.
-    int clusters_per_sector = SECTOR_SIZE / CLUSTER_SIZE;
-    uint16_t cluster_id = file->first_cluster;  // Start from the first cluster of the file.
-    int offset = 0;  // Initialize offset for data copying.
-
-    // Loop through each cluster in the file's cluster chain.
-    for (int i = 0; i <= file->size / CLUSTER_DATA_SIZE; i++) {
-        int sector_num = cluster_id / clusters_per_sector;  // Calculate the sector number of the current cluster.
-        int cluster_num = cluster_id % clusters_per_sector;  // Calculate the cluster index within the sector.
-
-        printf("\nreadloop");  // Debug print for each loop iteration.
-        
-        // If the needed sector is not already loaded, load it.
-        if (sb.sector != sector_num) {
-            flash_read_safe(sector_num, sb.buffer);  // Read the sector safely into the buffer.
-            sb.sector = sector_num;  // Update the sector buffer's current sector number.
+    for (;;) {
+        FS_FILE snapshot;
+        if (fs_stat(file, &snapshot) != 0) {
+            printf("Error: File not found.\n");
+            return NULL;
         }
 
-        // Access the specific cluster within the sector.
-        CLUSTER* cluster_array = (CLUSTER*) sb.buffer;
-        CLUSTER* cluster = &cluster_array[cluster_num];
-
-        // Determine the size of data to copy from the cluster.
-        int copy_size = (i == file->size / CLUSTER_DATA_SIZE && file->size % CLUSTER_DATA_SIZE != 0) ?
-                        file->size % CLUSTER_DATA_SIZE : CLUSTER_DATA_SIZE;
-
-        // Copy data from the cluster to the buffer.
-        memcpy(buffer + offset, cluster->buffer, copy_size);
-        offset += copy_size;  // Increment the offset by the size of the data copied.
+        // Allocate memory for the buffer to hold the file's data.
+        uint8_t* buffer = malloc(snapshot.size ? snapshot.size : 1);
+        if (buffer == NULL) {
+            printf("Memory allocation failed.\n"); // Check for successful memory allocation.
+            return NULL;  // Return NULL if memory allocation fails.
+        }
 
-        // Check if the end of the file cluster chain is reached.
-        if (cluster->next_cluster == CLUSTER_EOF) {
-            return buffer; // Return the buffer if end of file is reached.
+        // A size change between the stat and the read means the file was replaced; go again.
+        int read = fs_read_into(file, buffer, 0, snapshot.size);
+        if (read == (int)snapshot.size) {
+            return buffer;  // Return the buffer containing the file data.
+        }
+        free(buffer);
+        if (read < 0) {
+            return NULL;
         }
-        cluster_id = cluster->next_cluster;  // Move to the next cluster in the chain.
     }
+}
+#endif // FS_STATIC_MEMORY
 
-    // Print the entire file content as characters for debugging.
-    for (int i = 0; i < file->size; i++) {
-        printf("%c", buffer[i]);
-    }
-    printf("\n");
 
-    return buffer;  // Return the buffer containing the file data.
+// Undoes what it can of a failed fs_write_locked: restores the allocator bitmap and throws
+// away the dirty cache slots, so the next cache_get re-reads those sectors (and their
+// neighbours' live clusters) from flash. Writers flush before publishing, so nothing else was
+// pending. Sectors evicted to flash mid-write are not rolled back.
+static void fs_write_abort(const uint32_t *saved_map) {
+    memcpy(fs->free_map, saved_map, sizeof(fs->free_map));
+    cache_invalidate();
 }
 
-
 /**
  * Writes data from the provided buffer to the specified file.
  *
@@ -401,29 +900,61 @@ uint8_t* fs_read(FS_FILE* file) {
  * @param size   The number of bytes to write.
  * @return The number of bytes written, or -1 if an error occurred.
  */
-int fs_write(FS_FILE* file, const uint8_t *data, int size) {
+static int fs_write_locked(FS_FILE* file, const uint8_t *data, int size) {
+    uint16_t first_cluster = file->first_cluster;
+
+    // Check everything that can fail before the first cluster is touched, so a failed write
+    // normally changes nothing. The chain only ever grows forward from its first cluster, so
+    // only the free clusters from there on count, even when the caller preset first_cluster.
+    if (size < 0) {
+        return -1;
+    }
+    if (first_cluster != CLUSTER_EOF && first_cluster >= MAX_CLUSTERS) {
+        printf("Error: First cluster %u is out of range.\n", first_cluster);
+        return -1;
+    }
+    uint32_t needed = ((uint32_t)size + CLUSTER_DATA_SIZE - 1) / CLUSTER_DATA_SIZE;
+    uint32_t start = first_cluster == CLUSTER_EOF ? 0 : first_cluster;
+    uint32_t available = 0;
+    for (uint32_t i = start / 32; i < MAX_CLUSTERS / 32; i++) {
+        uint32_t word = fs->free_map[i];
+        if (i == start / 32) {
+            word &= ~0u << (start % 32);  // Clusters below start are out of reach.
+        }
+        available += __builtin_popcount(word);
+    }
+    if (needed > available) {
+        printf("Error: No free clusters available.\n");
+        return -1;
+    }
+
+    // A new file has no clusters yet, start it at the first free one.
+    if (first_cluster == CLUSTER_EOF && size > 0) {
+        first_cluster = fs_find_free_cluster(0);
+    }
+
+    // Should a check below still fail (a preset first cluster that is taken, or the bitmap
+    // disagreeing with flash), the clusters taken so far go back to the pool and the cache
+    // drops the sectors still dirty. Sectors the cache already evicted stay in flash; their
+    // clusters are unreferenced and show up as leaked until the next fs_init.
+    uint32_t saved_map[MAX_CLUSTERS / 32];
+    memcpy(saved_map, fs->free_map, sizeof(saved_map));
+
     uint32_t remaining_size = size;  // Track the amount of data left to write.
+    uint32_t clusters_used = 0;  // Clusters taken from the free pool.
     uint32_t offset = 0;  // Offset in the input data buffer.
-    uint16_t cluster_id = file->first_cluster;  // Start at the first cluster of the file.
+    uint16_t cluster_id = first_cluster;  // Start at the first cluster of the file.
     int clusters_per_sector = SECTOR_SIZE / CLUSTER_SIZE;  // Determine how many clusters each sector holds.
-    SECTOR_BUFFER sb = { .sector = -1, .dirty = false };  // Initialize a sector buffer.
 
     while (remaining_size > 0) {  // Loop until all data is written.
         int sector_num = cluster_id / clusters_per_sector;  // Calculate the sector number for the current cluster.
         int cluster_num = cluster_id % clusters_per_sector;  // Determine the cluster's position within its sector.
 
-        // Load the sector if it's not already loaded, or if it's dirty.
-        if (sb.sector != sector_num) {
-            if (sb.dirty) {
-                flash_write_safe(sb.sector, sb.buffer);  // Write back the dirty sector to storage.
-                sb.dirty = false;
-            }
-            flash_read_safe(sector_num, sb.buffer);  // Read the new sector into the buffer.
-            sb.sector = sector_num;  // Update the sector number in the buffer.
-        }
+        // Get the sector from the cache, which writes back whatever it evicts.
+        SECTOR_BUFFER *sb = cache_get(DATA_SECTOR(sector_num));
 
         // Access the cluster within the sector.
-        CLUSTER* cluster_array = (CLUSTER*)sb.buffer;
+        CLUSTER* cluster_array = (CLUSTER*)sb->buffer;
         CLUSTER* cluster = &cluster_array[cluster_num];
 
         // Only write to the cluster if it's free.
@@ -433,7 +964,9 @@ int fs_write(FS_FILE* file, const uint8_t *data, int size) {
             memcpy(cluster->buffer, data + offset, bytes_to_copy);
             offset += bytes_to_copy;
             remaining_size -= bytes_to_copy;
-            sb.dirty = true;  // Mark the sector as dirty.
+            sb->dirty = true;  // Mark the sector as dirty.
+            map_set(cluster_id, false);  // Take the cluster out of the free pool.
+            clusters_used++;
 
             printf("Debug: Copied %u bytes to cluster %u at offset %u. Remaining size: %u\n", bytes_to_copy, cluster_id, offset, remaining_size);
 
@@ -448,6 +981,7 @@ int fs_write(FS_FILE* file, const uint8_t *data, int size) {
                     printf("Debug: Assigned next free cluster ID %u\n", cluster_id);
                 } else {
                     printf("Error: No free clusters available.\n");
+                    fs_write_abort(saved_map);
                     return -1;  // Return error if no free clusters are found.
                 }
             } else {
@@ -455,20 +989,48 @@ int fs_write(FS_FILE* file, const uint8_t *data, int size) {
             }
         } else {
             printf("Error: Cluster %u is not free.\n", cluster_id);
+            fs_write_abort(saved_map);
             return -1;  // Return error if the cluster is not free.
         }
     }
 
     // Write any remaining dirty sector to storage.
-    if (sb.dirty) {
-        flash_write_safe(sb.sector, sb.buffer);
-    }
+    cache_flush();
+
+    // The data is in flash; publish the new chain, size and modify time in one step.
+    uint32_t irq = dir_write_begin();
+    file->first_cluster = first_cluster;
 
     // Update the file size if the new data exceeds the existing file size.
-    if (file->size < size) {
+    if (file->size < (uint32_t)size) {
         file->size = size;
     }
 
+    if (mounted_fat() != NULL) {
+        mounted_fat()->free_count -= clusters_used;
+    }
+
+    // Update the file's last modified timestamp and its place in the modify index.
+    fs_index_touch(file);
+    dir_write_end(irq);
+
     // Return the number of bytes written (could be modified to return actual bytes written).
     return offset;
 }
+
+// Writes data to a file while holding the writer lock.
+int fs_write(FS_FILE* file, const uint8_t *data, int size) {
+    if (file == NULL) {
+        return -1;
+    }
+
+    if (mounted_fat() == NULL) {
+        printf("Error: No FATable mounted.\n");
+        return -1;
+    }
+
+    fs_mutex_lock(&fs_writer);
+    int written = fs_write_locked(file, data, size);
+    fs_mutex_unlock(&fs_writer);
+    return written;
+}
@@ -17,9 +17,16 @@
 #define CLUSTER_SIZE 1024
 #define CLUSTER_DATA_SIZE 1022
 #define SECTOR_SIZE 4096
-#define CLUSTER_FREE 0xFFFFFFFF
-#define CLUSTER_EOF 0xFFFFFFFE
+#define CLUSTER_FREE 0xFFFF
+#define CLUSTER_EOF 0xFFFE
 #define META_SIZE 256
+#define MAX_FILES 100
+#define CLUSTERS_PER_SECTOR (SECTOR_SIZE / CLUSTER_SIZE)
+#define FS_TIME_MAX 0xFFFFFFFF
+#define FS_TIME_CREATE 0
+#define FS_TIME_MODIFY 1
+#define FS_READ_CHANGED -2
+#define FS_SECTOR_SEQS 32           // Erase-window counters shared out over the volume's sectors.
 
 // Defines a structure for a file in the filesystem.
 typedef struct {
@@ -36,10 +43,16 @@ typedef struct {
 
 // Represents the File Allocation Table containing file entries and cluster management information.
 typedef struct {
-    FS_FILE entries[100];  // Array of FS_FILE to store file information.
+    FS_FILE entries[MAX_FILES];  // Array of FS_FILE to store file information.
     uint32_t free_count;   // Number of free clusters available in the filesystem.
 } FATable;
 
+// The FATable occupies the first sectors of the volume; cluster data starts straight after it.
+#define FAT_SECTORS ((sizeof(FATable) + SECTOR_SIZE - 1) / SECTOR_SIZE)
+#define DATA_SECTOR(n) (FAT_SECTORS + (n))
+#define DATA_SECTOR_OFFSET(n) (DATA_SECTOR(n) * SECTOR_SIZE)
+#define FS_VOLUME_SIZE DATA_SECTOR_OFFSET(MAX_CLUSTERS / CLUSTERS_PER_SECTOR)
+
 // Represents a single cluster within the filesystem.
 typedef struct {
     uint16_t next_cluster;          // Index of the next cluster in the file, or special values like EOF.
@@ -53,14 +66,74 @@ typedef struct {
     uint32_t sector;                // Sector number that this buffer corresponds to.
 } SECTOR_BUFFER;
 
+// Sorted secondary index over one of the FATable timestamps, kept in RAM only.
+typedef struct {
+    uint32_t key[MAX_FILES];        // Packed datetime keys (see fs_time_key) in ascending order.
+    uint8_t slot[MAX_FILES];        // FATable entry index that each key belongs to.
+    uint8_t count;                  // Number of valid keys.
+} FS_TIME_INDEX;
+
+// Everything the filesystem keeps in RAM besides the FATable itself.
+typedef struct {
+    FATable *fat;                           // Mounted FATable.
+    FS_TIME_INDEX index[2];                 // Time indexes, addressed by FS_TIME_CREATE / FS_TIME_MODIFY.
+    uint32_t free_map[MAX_CLUSTERS / 32];   // Allocator bitmap, a set bit marks a free cluster.
+    SECTOR_BUFFER *cache;                   // Writer's sector cache; sector is the volume sector number.
+    uint8_t cache_slots;                    // Number of cache slots.
+    uint8_t cache_next;                     // Next slot to evict.
+} FS_STATE;
+
+// Bytes of arena fs_mount_arena needs for the given number of sector cache slots.
+// This is the filesystem's whole RAM footprint in an FS_STATIC_MEMORY build.
+#define FS_ARENA_SIZE(cache_slots) (sizeof(FS_STATE) + sizeof(FATable) + (cache_slots) * sizeof(SECTOR_BUFFER))
+
+#ifdef FS_STATIC_MEMORY
+#ifndef FS_CACHE_SLOTS
+#define FS_CACHE_SLOTS 2
+#endif
+#ifndef FS_RAM_BUDGET
+#define FS_RAM_BUDGET (48 * 1024)   // Checked against FS_ARENA_SIZE(FS_CACHE_SLOTS) at compile time.
+#endif
+#endif
+
+// Query used by fs_list to select directory entries.
+typedef struct {
+    uint8_t time_field;             // FS_TIME_CREATE or FS_TIME_MODIFY, picks the index to range over.
+    uint32_t from;                  // Inclusive lower bound as a packed key, 0 for no bound.
+    uint32_t to;                    // Inclusive upper bound as a packed key, FS_TIME_MAX for no bound.
+    const char *extension;          // Extension to match, or NULL for any.
+    uint8_t attr_mask;              // Attribute bits to compare...
+    uint8_t attr_value;             // ...and the value they must have.
+} FS_FILTER;
+
+// Called once per matching entry in time order. Return false to stop the listing early.
+typedef bool (*fs_list_callback)(const FS_FILE *file, void *ctx);
+
+// Called by fs_read_extents with each in-place piece of a file. Return false to stop.
+typedef bool (*fs_extent_callback)(const uint8_t *data, uint32_t len, void *ctx);
+
 
 void fat_init();
 void fs_init();
 void fat_read(FATable* fat);
+void fat_write(const FATable* fat);
+#ifndef FS_STATIC_MEMORY
+void fs_mount(FATable *fat);
+#endif
+FATable* fs_mount_arena(void *arena, size_t size);
+uint32_t fs_time_key(const datetime_t *t);
+int fs_list(const FS_FILTER *filter, fs_list_callback callback, void *ctx);
+int fs_stat(const FS_FILE *file, FS_FILE *out);
 void ls_directory();
 FS_FILE* fs_open(const char *filename, const char *mode, FATable *fat);
+FS_FILE* fat_fs_new(FATable *fat, const char *filename, const char *extension);
+int fs_delete(FATable *fat, FS_FILE *file);
 void fs_close(FS_FILE* file);
+#ifndef FS_STATIC_MEMORY
 uint8_t* fs_read(FS_FILE* file);
+#endif
+int fs_read_into(const FS_FILE* file, uint8_t *buffer, uint32_t offset, uint32_t len);
+int fs_read_extents(const FS_FILE* file, uint32_t offset, uint32_t len, fs_extent_callback callback, void *ctx);
 int fs_write(FS_FILE* file,  const uint8_t *data, int size);
 
 #endif // FILESYSTEM_H
\ No newline at end of file
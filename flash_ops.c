@@ -4,11 +4,39 @@
 
 #include "pico/stdlib.h"
 #include "hardware/flash.h"
-#include "hardware/sync.h"
+#include "pico/flash.h"
 
 #define FLASH_TARGET_OFFSET (256 * 1024) // Offset where user data starts (256KB into flash)
 #define FLASH_SIZE PICO_FLASH_SIZE_BYTES // Total flash size available
 
+// While a sector is erased or programmed the XIP window is gone for both cores: code run
+// from flash and reads through flash_map() would fetch garbage. flash_safe_execute parks
+// the other core in a RAM handler (multicore lockout) and masks interrupts on this one for
+// the duration, so nothing touches XIP until the operation is done. The other core must
+// have called flash_safe_execute_core_init() once at start-up, or not be running at all.
+
+// One erase-and-optional-program, run by flash_safe_execute.
+typedef struct {
+    uint32_t flash_offset;     // Absolute flash offset of the sector.
+    const uint8_t *data;       // Data to program, or NULL to only erase.
+} FLASH_OP;
+
+static void flash_op(void *param) {
+    const FLASH_OP *op = param;
+    flash_range_erase(op->flash_offset, FLASH_SECTOR_SIZE);
+    if (op->data != NULL) {
+        flash_range_program(op->flash_offset, op->data, FLASH_SECTOR_SIZE);
+    }
+}
+
+static void flash_op_run(uint32_t flash_offset, const uint8_t *data) {
+    FLASH_OP op = { .flash_offset = flash_offset, .data = data };
+    int result = flash_safe_execute(flash_op, &op, UINT32_MAX);
+    if (result != PICO_OK) {
+        printf("\nError: Flash operation failed: %d\n", result);
+    }
+}
+
 // Function: flash_write_safe
 // Writes data to flash memory at a specified offset, ensuring safety checks.
 //w
@@ -28,17 +56,8 @@ void flash_write_safe(uint32_t offset, const uint8_t *data) {
         return;
     }
 
-    // Disable interrupts for a safe flash operation
-    uint32_t ints = save_and_disable_interrupts();
-
-    // Erase the flash sector before writing
-    flash_range_erase(flash_offset, FLASH_SECTOR_SIZE);
-
-    // Write data to flash
-    flash_range_program(flash_offset, data, 4096);
-
-    // Restore interrupts
-    restore_interrupts(ints);
+    // Erase the flash sector and write the data with the other core parked
+    flash_op_run(flash_offset, data);
 }
 
 // Function: flash_read_safe
@@ -83,12 +102,29 @@ void flash_erase_safe(uint32_t offset) {
         return;
     }
 
-    // Disable interrupts for a safe flash operation
-    uint32_t ints = save_and_disable_interrupts();
+    // Erase the flash sector with the other core parked
+    flash_op_run(flash_offset & ~(FLASH_SECTOR_SIZE - 1), NULL);
+}
 
-    // Erase the flash sector
-    flash_range_erase(flash_offset, FLASH_SECTOR_SIZE);
+// Function: flash_map
+// Returns a pointer to the memory-mapped (XIP) copy of the flash at the given offset, so
+// callers can read in place instead of copying a sector into a buffer first.
+//
+// Parameters:
+// - offset: The offset from FLASH_TARGET_OFFSET to map.
+//
+// Note: Returns NULL when the offset is out of bounds. The mapping is unreadable while a
+// write or erase is in progress, which is why those park the other core (see flash_op_run).
+const uint8_t *flash_map(uint32_t offset) {
+
+    // Calculate absolute flash offset
+    uint32_t flash_offset = FLASH_TARGET_OFFSET + offset;
+
+    // Check that the offset is within bounds
+    if (flash_offset >= FLASH_TARGET_OFFSET + FLASH_SIZE || flash_offset < FLASH_TARGET_OFFSET) {
+        printf("Error: Map out of bounds\n");
+        return NULL;
+    }
 
-    // Restore interrupts
-    restore_interrupts(ints);
+    return (const uint8_t *)(XIP_BASE + flash_offset);
 }
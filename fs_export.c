@@ -0,0 +1,403 @@
+#include "fs_export.h"
+#include "flash_ops.h"
+#include <string.h>
+
+#ifndef FS_HOST_BUILD
+#include "pico/stdlib.h"
+#include "pico/stdio_usb.h"
+#endif
+
+// Serves the export protocol described in fs_export.h. Nothing is staged in RAM: file data
+// goes from the flash mapping straight to the stream, one cluster at a time, so a transfer
+// runs as fast as the link and costs no more memory than a listing. Reads take no locks
+// (see filesystem.c), so the writer on the other core keeps logging while a host downloads.
+// The server runs on main()'s small stack, so its larger buffers are static; the deepest path
+// (a listing, under fs_list) stays under 1 KB.
+// On the board the CDC port belongs to the export protocol while it is served; printf
+// output is kept off it (see fs_export_serve_usb).
+
+// A frame being written out piece by piece, with its CRC built up as it goes.
+typedef struct {
+    const FS_EXPORT_IO *io;
+    uint32_t crc;       // Running CRC, not yet finalised.
+    uint32_t length;    // Payload length given in the header.
+    uint32_t written;   // Payload bytes sent so far.
+    bool ok;            // Cleared once a write fails; everything after is dropped.
+} FRAME;
+
+static uint32_t crc_table[256];
+
+// Function: fs_crc32
+// Continues a CRC-32 (IEEE, reflected, as zlib) over len bytes. Start with crc = 0.
+uint32_t fs_crc32(uint32_t crc, const void *data, size_t len) {
+    if (crc_table[1] == 0) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            crc_table[n] = c;
+        }
+    }
+
+    const uint8_t *p = data;
+    crc = ~crc;
+    while (len--) {
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void frame_begin(FRAME *frame, const FS_EXPORT_IO *io, uint8_t type, uint32_t len) {
+    uint8_t header[FS_EXPORT_HEADER_SIZE] = { FS_EXPORT_MAGIC0, FS_EXPORT_MAGIC1, type, 0 };
+    put32(header + 4, len);
+
+    frame->io = io;
+    frame->length = len;
+    frame->written = 0;
+    frame->ok = io->write(io->ctx, header, sizeof(header));
+    frame->crc = fs_crc32(0, header + 2, sizeof(header) - 2);
+}
+
+static bool frame_part(FRAME *frame, const uint8_t *data, uint32_t len) {
+    if (frame->ok) {
+        frame->crc = fs_crc32(frame->crc, data, len);
+        frame->ok = frame->io->write(frame->io->ctx, data, len);
+        frame->written += len;
+    }
+    return frame->ok;
+}
+
+// Closes the frame. A frame whose contents turned out to be wrong is sent with a CRC that
+// cannot match, so the receiver throws it away.
+static bool frame_end(FRAME *frame, bool good) {
+    uint8_t trailer[4];
+    put32(trailer, good ? frame->crc : ~frame->crc);
+    if (frame->ok) {
+        frame->ok = frame->io->write(frame->io->ctx, trailer, sizeof(trailer));
+    }
+    return frame->ok;
+}
+
+static bool send_frame(const FS_EXPORT_IO *io, uint8_t type, const uint8_t *payload, uint32_t len) {
+    FRAME frame;
+    frame_begin(&frame, io, type, len);
+    frame_part(&frame, payload, len);
+    return frame_end(&frame, true);
+}
+
+static bool send_error(const FS_EXPORT_IO *io, uint8_t code, const char *text) {
+    uint8_t payload[64];
+    size_t len = strlen(text);
+    if (len > sizeof(payload) - 1) {
+        len = sizeof(payload) - 1;
+    }
+    payload[0] = code;
+    memcpy(payload + 1, text, len);
+    return send_frame(io, FS_EXPORT_ERROR, payload, len + 1);
+}
+
+static bool send_done(const FS_EXPORT_IO *io, uint32_t count) {
+    uint8_t payload[4];
+    put32(payload, count);
+    return send_frame(io, FS_EXPORT_DONE, payload, sizeof(payload));
+}
+
+static bool send_entry(const FS_EXPORT_IO *io, const FS_FILE *file) {
+    static uint8_t payload[4 * 3 + 1 + 1 + MAX_FILENAME_LENGTH + 1 + MAX_EXTENSION_LENGTH];
+    uint8_t name_len = strnlen(file->filename, MAX_FILENAME_LENGTH);
+    uint8_t ext_len = strnlen(file->extension, MAX_EXTENSION_LENGTH);
+    uint8_t *p = payload;
+
+    put32(p, file->size);
+    put32(p + 4, fs_time_key(&file->create_datetime));
+    put32(p + 8, fs_time_key(&file->last_mod_datetime));
+    p[12] = file->attributes;
+    p += 13;
+    *p++ = name_len;
+    memcpy(p, file->filename, name_len);
+    p += name_len;
+    *p++ = ext_len;
+    memcpy(p, file->extension, ext_len);
+    p += ext_len;
+
+    return send_frame(io, FS_EXPORT_ENTRY, payload, p - payload);
+}
+
+static bool list_entry(const FS_FILE *file, void *ctx) {
+    return send_entry(ctx, file);
+}
+
+static bool stream_extent(const uint8_t *data, uint32_t len, void *ctx) {
+    return frame_part(ctx, data, len);
+}
+
+// Sends the entries matching an optional time range, then 'Z' with how many there were.
+static bool serve_list(const FS_EXPORT_IO *io, const uint8_t *payload, uint32_t len) {
+    FS_FILTER filter = { .time_field = FS_TIME_CREATE, .from = 0, .to = FS_TIME_MAX };
+    if (len >= 9) {
+        filter.time_field = payload[0];
+        filter.from = get32(payload + 1);
+        filter.to = get32(payload + 5);
+    }
+
+    int count = fs_list(&filter, list_entry, (void *)io);
+    return send_done(io, count > 0 ? count : 0);
+}
+
+// Finds "name.ext" in the table, returning the live entry and a copy of it.
+static FS_FILE *find_file(FATable *fat, const char *name, FS_FILE *out) {
+    const char *dot = strrchr(name, '.');
+    size_t stem = dot != NULL ? (size_t)(dot - name) : strlen(name);
+    const char *ext = dot != NULL ? dot + 1 : "";
+
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (fs_stat(&fat->entries[i], out) != 0) {
+            continue;
+        }
+        if (strnlen(out->filename, MAX_FILENAME_LENGTH) == stem && strncmp(out->filename, name, stem) == 0 &&
+            strncmp(out->extension, ext, MAX_EXTENSION_LENGTH) == 0) {
+            return &fat->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// What a 'get' needs to tell whether the file changed under it.
+typedef struct {
+    uint16_t first_cluster;
+    uint32_t size;
+    uint32_t create_key;
+    uint32_t mod_key;
+} FILE_VERSION;
+
+static void file_version(const FS_FILE *file, FILE_VERSION *version) {
+    version->first_cluster = file->first_cluster;
+    version->size = file->size;
+    version->create_key = fs_time_key(&file->create_datetime);
+    version->mod_key = fs_time_key(&file->last_mod_datetime);
+}
+
+// True if the entry still describes the same contents as the version sent in 'E'.
+// entry is scratch space for the fresh copy.
+static bool same_file(const FS_FILE *file, const FILE_VERSION *sent, FS_FILE *entry) {
+    FILE_VERSION now;
+    if (fs_stat(file, entry) != 0) {
+        return false;
+    }
+    file_version(entry, &now);
+    return now.first_cluster == sent->first_cluster && now.size == sent->size &&
+           now.create_key == sent->create_key && now.mod_key == sent->mod_key;
+}
+
+// Streams a file from the requested offset: 'E', 'D' frames straight out of flash, then 'Z'.
+// The name and the entry copy are static (there is one server) to keep the stack small.
+static bool serve_get(const FS_EXPORT_IO *io, FATable *fat, const uint8_t *payload, uint32_t len) {
+    static char name[MAX_FILENAME_LENGTH + MAX_EXTENSION_LENGTH + 2];
+    static FS_FILE entry;
+    if (len < 5 || len - 4 >= sizeof(name)) {
+        return send_error(io, FS_EXPORT_BAD_REQUEST, "bad get request");
+    }
+    uint32_t offset = get32(payload);
+    memcpy(name, payload + 4, len - 4);
+    name[len - 4] = '\0';
+
+    FS_FILE *file = find_file(fat, name, &entry);
+    if (file == NULL) {
+        return send_error(io, FS_EXPORT_NOT_FOUND, "no such file");
+    }
+    FILE_VERSION sent;
+    file_version(&entry, &sent);
+    if (offset > sent.size) {
+        return send_error(io, FS_EXPORT_RANGE, "offset past end of file");
+    }
+    if (!send_entry(io, &entry)) {
+        return false;
+    }
+
+    for (uint32_t pos = offset; pos < sent.size; ) {
+        uint32_t chunk = sent.size - pos < FS_EXPORT_CHUNK ? sent.size - pos : FS_EXPORT_CHUNK;
+        uint8_t head[4];
+        put32(head, pos);
+
+        FRAME frame;
+        frame_begin(&frame, io, FS_EXPORT_DATA, sizeof(head) + chunk);
+        frame_part(&frame, head, sizeof(head));
+        int n = fs_read_extents(file, pos, chunk, stream_extent, &frame);
+        if (!frame.ok) {
+            return false;
+        }
+
+        if (n != (int)chunk || !same_file(file, &sent, &entry)) {
+            // The frame length is already out; fill what is left of it, however much the read
+            // got through, then spoil it and tell the host why.
+            static const uint8_t zeros[64];
+            for (uint32_t pad = frame.length - frame.written; pad > 0; ) {
+                uint32_t part = pad < sizeof(zeros) ? pad : sizeof(zeros);
+                frame_part(&frame, zeros, part);
+                pad -= part;
+            }
+            frame_end(&frame, false);
+            return send_error(io, FS_EXPORT_CHANGED, "file changed during transfer");
+        }
+        if (!frame_end(&frame, true)) {
+            return false;
+        }
+        pos += chunk;
+    }
+    return send_done(io, sent.size - offset);
+}
+
+// Streams raw volume bytes straight out of the flash mapping. No consistency with a running
+// writer is attempted: this is for imaging a quiet device or post-mortem.
+static bool serve_raw(const FS_EXPORT_IO *io, const uint8_t *payload, uint32_t len) {
+    if (len < 8) {
+        return send_error(io, FS_EXPORT_BAD_REQUEST, "bad raw request");
+    }
+    uint32_t offset = get32(payload);
+    uint32_t length = get32(payload + 4);
+    if (offset > FS_VOLUME_SIZE || length > FS_VOLUME_SIZE - offset) {
+        return send_error(io, FS_EXPORT_RANGE, "range outside volume");
+    }
+
+    for (uint32_t pos = offset; pos < offset + length; ) {
+        uint32_t chunk = offset + length - pos < FS_EXPORT_CHUNK ? offset + length - pos : FS_EXPORT_CHUNK;
+        const uint8_t *data = flash_map(pos);
+        if (data == NULL) {
+            return send_error(io, FS_EXPORT_RANGE, "range not mapped");
+        }
+        uint8_t head[4];
+        put32(head, pos);
+
+        FRAME frame;
+        frame_begin(&frame, io, FS_EXPORT_DATA, sizeof(head) + chunk);
+        frame_part(&frame, head, sizeof(head));
+        frame_part(&frame, data, chunk);
+        if (!frame_end(&frame, true)) {
+            return false;
+        }
+        pos += chunk;
+    }
+    return send_done(io, length);
+}
+
+static bool read_exact(const FS_EXPORT_IO *io, uint8_t *buf, uint32_t len) {
+    while (len > 0) {
+        int n = io->read(io->ctx, buf, len);
+        if (n < 1) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Function: fs_export_serve
+// Answers requests on io until the stream closes. Line noise and anything that is not a
+// frame (a terminal echoing, a stray printf) is skipped by hunting for the magic bytes.
+// Returns 0 once the stream is closed.
+int fs_export_serve(const FS_EXPORT_IO *io, FATable *fat) {
+    uint8_t header[FS_EXPORT_HEADER_SIZE];
+    static uint8_t payload[FS_EXPORT_MAX_REQUEST + 4];   // One server, so off the stack.
+
+    for (;;) {
+        // Resynchronise on "FX".
+        if (!read_exact(io, header, 1)) {
+            return 0;
+        }
+        if (header[0] != FS_EXPORT_MAGIC0) {
+            continue;
+        }
+        if (!read_exact(io, header + 1, 1)) {
+            return 0;
+        }
+        if (header[1] != FS_EXPORT_MAGIC1) {
+            continue;
+        }
+        if (!read_exact(io, header + 2, sizeof(header) - 2)) {
+            return 0;
+        }
+
+        uint32_t len = get32(header + 4);
+        if (len > FS_EXPORT_MAX_REQUEST) {
+            send_error(io, FS_EXPORT_BAD_REQUEST, "request too long");
+            continue;
+        }
+        if (!read_exact(io, payload, len + 4)) {
+            return 0;
+        }
+
+        uint32_t crc = fs_crc32(fs_crc32(0, header + 2, sizeof(header) - 2), payload, len);
+        bool alive;
+        if (crc != get32(payload + len)) {
+            alive = send_error(io, FS_EXPORT_BAD_REQUEST, "bad crc");
+        } else if (header[2] == FS_EXPORT_LIST) {
+            alive = serve_list(io, payload, len);
+        } else if (header[2] == FS_EXPORT_GET) {
+            alive = serve_get(io, fat, payload, len);
+        } else if (header[2] == FS_EXPORT_RAW) {
+            alive = serve_raw(io, payload, len);
+        } else {
+            alive = send_error(io, FS_EXPORT_BAD_REQUEST, "unknown request");
+        }
+
+        if (io->flush != NULL) {
+            io->flush(io->ctx);
+        }
+        if (!alive) {
+            return 0;
+        }
+    }
+}
+
+#ifndef FS_HOST_BUILD
+// The USB functions talk to the CDC driver directly rather than through stdio, so frames
+// skip newline translation and nothing printf'd can land in the middle of one.
+static int usb_read(void *ctx, uint8_t *buf, uint32_t len) {
+    (void)ctx;
+    int n;
+    while ((n = stdio_usb.in_chars((char *)buf, (int)len)) <= 0) {
+        tight_loop_contents();
+    }
+    return n;
+}
+
+static bool usb_write(void *ctx, const uint8_t *data, uint32_t len) {
+    (void)ctx;
+    stdio_usb.out_chars((const char *)data, (int)len);
+    return stdio_usb_connected();
+}
+
+static void usb_flush(void *ctx) {
+    (void)ctx;
+    if (stdio_usb.out_flush != NULL) {
+        stdio_usb.out_flush();
+    }
+}
+
+// Function: fs_export_serve_usb
+// Serves the export protocol on the USB CDC port forever. The port is taken out of stdio
+// first, so printf output from either core (the filesystem's "Debug:" lines included) no
+// longer reaches USB and cannot break up a frame; it still goes to any other stdio driver
+// such as the UART.
+void fs_export_serve_usb(FATable *fat) {
+    static const FS_EXPORT_IO usb = { usb_read, usb_write, usb_flush, NULL };
+    stdio_flush();
+    stdio_set_driver_enabled(&stdio_usb, false);
+    for (;;) {
+        fs_export_serve(&usb, fat);
+    }
+}
+#endif
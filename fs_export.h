@@ -0,0 +1,64 @@
+#ifndef FS_EXPORT_H
+#define FS_EXPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "filesystem.h"
+
+// Binary bulk export of the filesystem over a byte stream (USB CDC on the board, a pipe on
+// the host). Every message, in either direction, is one frame:
+//
+//   'F' 'X' type flags length:u32 payload[length] crc:u32
+//
+// All integers are little-endian. crc is CRC-32 (IEEE) over type, flags, length and the
+// payload, so a receiver can drop a damaged frame and ask again from the last good offset.
+//
+// Requests (host to board):
+//   'L' list   [time_field:u8 from:u32 to:u32]    Entries in time order (fs_list), all if empty.
+//   'G' get    offset:u32 name                    File "name.ext" from offset to the end.
+//   'R' raw    offset:u32 length:u32              Raw volume bytes, FATable and clusters alike.
+// Responses (board to host):
+//   'E' entry  size:u32 create:u32 modify:u32 attributes:u8 name_len:u8 name ext_len:u8 ext
+//   'D' data   offset:u32 bytes                   At most FS_EXPORT_CHUNK bytes.
+//   'Z' done   count:u32                          Entries listed, or bytes sent for 'G' / 'R'.
+//   'X' error  code:u8 text
+//
+// A get answers with the file's entry, its data frames and 'Z'. If the file is deleted or
+// rewritten while it streams, the frame in flight goes out with a bad CRC followed by 'X'
+// FS_EXPORT_CHANGED; the receiver keeps what it had and asks again from there.
+
+#define FS_EXPORT_MAGIC0 'F'
+#define FS_EXPORT_MAGIC1 'X'
+#define FS_EXPORT_HEADER_SIZE 8
+#define FS_EXPORT_CHUNK 16384           // Data bytes per 'D' frame.
+#define FS_EXPORT_MAX_REQUEST 256       // Largest request payload the board accepts.
+
+#define FS_EXPORT_LIST 'L'
+#define FS_EXPORT_GET 'G'
+#define FS_EXPORT_RAW 'R'
+#define FS_EXPORT_ENTRY 'E'
+#define FS_EXPORT_DATA 'D'
+#define FS_EXPORT_DONE 'Z'
+#define FS_EXPORT_ERROR 'X'
+
+#define FS_EXPORT_NOT_FOUND 1           // No file by that name.
+#define FS_EXPORT_CHANGED 2             // The file changed mid-transfer, request again.
+#define FS_EXPORT_BAD_REQUEST 3         // Unknown type, bad length or bad CRC.
+#define FS_EXPORT_RANGE 4               // Offset or length outside the file or volume.
+
+// Byte stream the export runs over.
+typedef struct {
+    int (*read)(void *ctx, uint8_t *buf, uint32_t len);         // Blocks for up to len bytes, returns < 1 when closed.
+    bool (*write)(void *ctx, const uint8_t *data, uint32_t len); // Writes all of data, false when closed.
+    void (*flush)(void *ctx);                                   // Pushes out buffered bytes, may be NULL.
+    void *ctx;                                                  // Passed to the functions above.
+} FS_EXPORT_IO;
+
+uint32_t fs_crc32(uint32_t crc, const void *data, size_t len);
+int fs_export_serve(const FS_EXPORT_IO *io, FATable *fat);
+#ifndef FS_HOST_BUILD
+void fs_export_serve_usb(FATable *fat);
+#endif
+
+#endif // FS_EXPORT_H
@@ -0,0 +1,86 @@
+#include "fs_sync.h"
+
+#ifndef FS_HOST_BUILD
+#include "hardware/sync.h"
+#endif
+
+// Function: fs_mutex_lock / fs_mutex_unlock
+// Writer lock, defined with FS_MUTEX_DEFINE so it is ready before main runs.
+// Blocks, so it must never be taken from an interrupt handler.
+void fs_mutex_lock(fs_mutex_t *m) {
+#ifdef FS_HOST_BUILD
+    pthread_mutex_lock(m);
+#else
+    mutex_enter_blocking(m);
+#endif
+}
+
+void fs_mutex_unlock(fs_mutex_t *m) {
+#ifdef FS_HOST_BUILD
+    pthread_mutex_unlock(m);
+#else
+    mutex_exit(m);
+#endif
+}
+
+// Function: fs_irq_save / fs_irq_restore
+// Masks interrupts on the calling core so an ISR can never see a write section half done
+// (it would otherwise spin forever waiting for the interrupted writer). No-op on the host.
+uint32_t fs_irq_save(void) {
+#ifdef FS_HOST_BUILD
+    return 0;
+#else
+    return save_and_disable_interrupts();
+#endif
+}
+
+void fs_irq_restore(uint32_t state) {
+#ifdef FS_HOST_BUILD
+    (void)state;
+#else
+    restore_interrupts(state);
+#endif
+}
+
+void fs_seq_init(fs_seqlock_t *s) {
+    atomic_store_explicit(&s->seq, 0, memory_order_relaxed);
+}
+
+// Function: fs_seq_write_begin / fs_seq_write_end
+// Bracket a change to the guarded data. Only the holder of the writer lock may call these,
+// so a plain load and store is enough (no read-modify-write, which the M0+ lacks).
+void fs_seq_write_begin(fs_seqlock_t *s) {
+    uint32_t seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);  // Odd count is visible before any data change.
+}
+
+void fs_seq_write_end(fs_seqlock_t *s) {
+    uint32_t seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->seq, seq + 1, memory_order_release);  // Data changes are visible before the even count.
+}
+
+// Function: fs_seq_read_begin / fs_seq_read_retry
+// Bracket a lock-free read: copy the data between the two calls and start again while
+// retry returns true. Begin waits out a write in progress. On fs_dir_seq that is a few RAM
+// updates; on a sector counter it is one sector erase plus program (see sector_write), and
+// on the board the reading core is parked by flash_safe_execute for that time anyway.
+uint32_t fs_seq_read_begin(const fs_seqlock_t *s) {
+    uint32_t seq;
+    while ((seq = atomic_load_explicit(&s->seq, memory_order_acquire)) & 1) {
+        // Writer is mid-update on the other core.
+    }
+    return seq;
+}
+
+bool fs_seq_read_retry(const fs_seqlock_t *s, uint32_t start) {
+    atomic_thread_fence(memory_order_acquire);  // Data reads complete before the count is checked.
+    return atomic_load_explicit(&s->seq, memory_order_relaxed) != start;
+}
+
+// Function: fs_seq_peek
+// Current count without waiting, odd or even. Used as a version number for data that is
+// validated after the fact rather than read inside a begin/retry loop.
+uint32_t fs_seq_peek(const fs_seqlock_t *s) {
+    return atomic_load_explicit(&s->seq, memory_order_acquire);
+}
@@ -0,0 +1,37 @@
+#ifndef FS_SYNC_H
+#define FS_SYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#ifdef FS_HOST_BUILD
+#include <pthread.h>
+typedef pthread_mutex_t fs_mutex_t;
+#define FS_MUTEX_DEFINE(name) static fs_mutex_t name = PTHREAD_MUTEX_INITIALIZER
+#else
+#include "pico/mutex.h"
+typedef mutex_t fs_mutex_t;
+#define FS_MUTEX_DEFINE(name) auto_init_mutex(name)
+#endif
+
+// Sequence counter guarding data that is written by one writer and read without locks.
+// Even while the data is stable, odd while the writer is part way through changing it.
+typedef struct {
+    _Atomic uint32_t seq;
+} fs_seqlock_t;
+
+void fs_mutex_lock(fs_mutex_t *m);
+void fs_mutex_unlock(fs_mutex_t *m);
+
+uint32_t fs_irq_save(void);
+void fs_irq_restore(uint32_t state);
+
+void fs_seq_init(fs_seqlock_t *s);
+void fs_seq_write_begin(fs_seqlock_t *s);
+void fs_seq_write_end(fs_seqlock_t *s);
+uint32_t fs_seq_read_begin(const fs_seqlock_t *s);
+bool fs_seq_read_retry(const fs_seqlock_t *s, uint32_t start);
+uint32_t fs_seq_peek(const fs_seqlock_t *s);
+
+#endif // FS_SYNC_H
@@ -0,0 +1,66 @@
+#include "flash_ops.h"
+#include "flash_host.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Host implementation of flash_ops.h. Offsets are relative to the start of the filesystem
+// volume, exactly as on the board, and map onto whatever memory flash_host_attach was given
+// (a malloc'd buffer or an mmap'd image file).
+
+static uint8_t *flash_base = NULL;
+static size_t flash_size = 0;
+
+// Stands in for the time an erase takes, so readers on other threads get to see the blank
+// sector. Real sector erases take tens of milliseconds; this only has to be long enough for
+// another thread to notice, and spins rather than sleeps to keep the stress test fast.
+static void flash_host_busy(void) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec) < 5000);
+}
+
+// Function: flash_host_attach
+// Points the flash operations at a memory region standing in for the volume.
+void flash_host_attach(uint8_t *base, size_t size) {
+    flash_base = base;
+    flash_size = size;
+}
+
+void flash_write_safe(uint32_t offset, const uint8_t *data) {
+    if (flash_base == NULL || offset + 4096 > flash_size) {
+        printf("\nError: Write out of bounds\n");
+        return;
+    }
+    // Like NOR flash: the sector reads as erased for a while before the new data lands.
+    memset(flash_base + offset, 0xFF, 4096);
+    flash_host_busy();
+    memcpy(flash_base + offset, data, 4096);
+}
+
+void flash_read_safe(uint32_t offset, uint8_t *buffer) {
+    if (flash_base == NULL || offset + 4096 > flash_size) {
+        printf("\nError: Read out of bounds\n");
+        return;
+    }
+    memcpy(buffer, flash_base + offset, 4096);
+}
+
+void flash_erase_safe(uint32_t offset) {
+    if (flash_base == NULL || offset >= flash_size) {
+        printf("Error: Erase out of bounds\n");
+        return;
+    }
+    memset(flash_base + (offset & ~4095u), 0xFF, 4096);
+    flash_host_busy();
+}
+
+const uint8_t *flash_map(uint32_t offset) {
+    if (flash_base == NULL || offset >= flash_size) {
+        printf("Error: Map out of bounds\n");
+        return NULL;
+    }
+    return flash_base + offset;
+}
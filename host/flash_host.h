@@ -0,0 +1,9 @@
+#ifndef FLASH_HOST_H
+#define FLASH_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+void flash_host_attach(uint8_t *base, size_t size);
+
+#endif // FLASH_HOST_H
@@ -0,0 +1,164 @@
+#include "filesystem.h"
+#include "fs_export.h"
+#include "flash_host.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Runs the export server over a pair of pipes and deletes the file being fetched part way
+// through a data frame, from inside the server's own write path so it lands at the same
+// byte every run. The reply is parsed strictly, without hunting for the magic, so a frame
+// that is longer or shorter than its header says breaks the parse.
+//
+// Usage: fs_export_test
+
+#define FILE_SIZE (3 * FS_EXPORT_CHUNK)
+#define DELETE_AT (FS_EXPORT_CHUNK + FS_EXPORT_CHUNK / 2)   // Stream bytes before the delete.
+
+static uint8_t image[FS_VOLUME_SIZE];
+#ifdef FS_STATIC_MEMORY
+static uint8_t arena[FS_ARENA_SIZE(FS_CACHE_SLOTS)] __attribute__((aligned(8)));
+#else
+static FATable fat_storage;
+#endif
+static FATable *fat;
+static FS_FILE *victim;
+static int to_server[2], from_server[2];
+static uint32_t streamed;
+static int failures;
+
+static int pipe_read(void *ctx, uint8_t *buf, uint32_t len) {
+    (void)ctx;
+    return read(to_server[0], buf, len);
+}
+
+static bool pipe_write(void *ctx, const uint8_t *data, uint32_t len) {
+    (void)ctx;
+    for (uint32_t done = 0; done < len; ) {
+        ssize_t n = write(from_server[1], data + done, len - done);
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+
+    // Halfway through the second data frame, the file goes away.
+    streamed += len;
+    if (victim != NULL && streamed >= DELETE_AT) {
+        fs_delete(fat, victim);
+        victim = NULL;
+    }
+    return true;
+}
+
+static void *server(void *arg) {
+    static const FS_EXPORT_IO io = { pipe_read, pipe_write, NULL, NULL };
+    fs_export_serve(&io, arg);
+    close(from_server[1]);
+    return NULL;
+}
+
+static void fail(const char *what) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    failures++;
+}
+
+static bool read_all(uint8_t *buf, uint32_t len) {
+    while (len > 0) {
+        ssize_t n = read(from_server[0], buf, len);
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Reads one frame that must start right here. Returns its type, or 0 if the stream is not
+// where a frame should be.
+static uint8_t next_frame(uint8_t *payload, uint32_t *len, bool *crc_ok) {
+    uint8_t header[FS_EXPORT_HEADER_SIZE], trailer[4];
+    if (!read_all(header, sizeof(header)) || header[0] != FS_EXPORT_MAGIC0 || header[1] != FS_EXPORT_MAGIC1) {
+        return 0;
+    }
+    *len = get32(header + 4);
+    if (*len > FS_EXPORT_CHUNK + 4 || !read_all(payload, *len) || !read_all(trailer, sizeof(trailer))) {
+        return 0;
+    }
+    uint32_t crc = fs_crc32(fs_crc32(0, header + 2, sizeof(header) - 2), payload, *len);
+    *crc_ok = crc == get32(trailer);
+    return header[2];
+}
+
+int main(void) {
+    static uint8_t data[FILE_SIZE], payload[FS_EXPORT_CHUNK + 4];
+
+    freopen("/dev/null", "w", stdout);
+    flash_host_attach(image, sizeof(image));
+#ifdef FS_STATIC_MEMORY
+    fat = fs_mount_arena(arena, sizeof(arena));
+    fs_init();
+    fat_init();
+    fat = fs_mount_arena(arena, sizeof(arena));
+#else
+    fs_init();
+    fat_init();
+    fat_read(&fat_storage);
+    fs_mount(&fat_storage);
+    fat = &fat_storage;
+#endif
+
+    for (uint32_t i = 0; i < FILE_SIZE; i++) {
+        data[i] = (uint8_t)(i * 13);
+    }
+    victim = fat_fs_new(fat, "victim", "bin");
+    fs_write(victim, data, FILE_SIZE);
+
+    if (pipe(to_server) != 0 || pipe(from_server) != 0) {
+        perror("pipe");
+        return 2;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, server, fat);
+
+    // Request the whole file: 'G' offset 0 "victim.bin".
+    uint8_t request[FS_EXPORT_HEADER_SIZE + 4 + 10 + 4] = { FS_EXPORT_MAGIC0, FS_EXPORT_MAGIC1, FS_EXPORT_GET, 0, 14 };
+    memcpy(request + FS_EXPORT_HEADER_SIZE + 4, "victim.bin", 10);
+    uint32_t crc = fs_crc32(0, request + 2, sizeof(request) - 6);
+    for (int i = 0; i < 4; i++) {
+        request[sizeof(request) - 4 + i] = crc >> (8 * i);   // Little-endian, like every field.
+    }
+    if (write(to_server[1], request, sizeof(request)) != sizeof(request)) {
+        perror("write");
+        return 2;
+    }
+
+    // Expect: entry, one good data frame, one spoilt one of exactly its declared length, changed.
+    uint32_t len;
+    bool crc_ok;
+    if (next_frame(payload, &len, &crc_ok) != FS_EXPORT_ENTRY || !crc_ok) {
+        fail("no entry frame");
+    }
+    if (next_frame(payload, &len, &crc_ok) != FS_EXPORT_DATA || !crc_ok || len != FS_EXPORT_CHUNK + 4 ||
+        memcmp(payload + 4, data, FS_EXPORT_CHUNK) != 0) {
+        fail("first data frame is not intact");
+    }
+    if (next_frame(payload, &len, &crc_ok) != FS_EXPORT_DATA || crc_ok) {
+        fail("data frame cut by the delete is not a spoilt data frame");
+    }
+    if (next_frame(payload, &len, &crc_ok) != FS_EXPORT_ERROR || !crc_ok || payload[0] != FS_EXPORT_CHANGED) {
+        fail("no changed error after the spoilt frame, the frame was not its declared length");
+    }
+
+    close(to_server[1]);
+    pthread_join(thread, NULL);
+
+    fprintf(stderr, "export delete-mid-get: %d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,181 @@
+#include "filesystem.h"
+#include "flash_host.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+// Checks fs_list queries against files stamped at known times: fs_time_key ordering across
+// hour, month and year boundaries, inclusive range ends, the extension and attribute filters,
+// and the indexes after fs_write moves a modify time and fs_delete frees a slot.
+//
+// Usage: fs_query_test
+
+static uint8_t image[FS_VOLUME_SIZE];
+static FATable *fat;
+#ifdef FS_STATIC_MEMORY
+static uint8_t arena[FS_ARENA_SIZE(FS_CACHE_SLOTS)] __attribute__((aligned(8)));
+#else
+static FATable fat_storage;
+#endif
+static int failures;
+
+static datetime_t at(int year, int month, int day, int hour, int min, int sec) {
+    datetime_t t = { .year = year, .month = month, .day = day, .hour = hour, .min = min, .sec = sec };
+    return t;
+}
+
+static uint32_t key(int year, int month, int day, int hour, int min, int sec) {
+    datetime_t t = at(year, month, day, hour, min, sec);
+    return fs_time_key(&t);
+}
+
+static void fail(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "FAIL: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    failures++;
+}
+
+// Creates name.ext with the RTC pinned to t.
+static FS_FILE *create(const char *name, const char *ext, datetime_t t) {
+    rtc_set_datetime(&t);
+    FS_FILE *file = fat_fs_new(fat, name, ext);
+    if (file == NULL) {
+        fail("create of %s.%s failed", name, ext);
+    }
+    return file;
+}
+
+// Collects the listed names as "a b c".
+typedef struct {
+    char names[256];
+    int limit;          // Stop after this many, 0 for no limit.
+    int seen;
+} RESULT;
+
+static bool collect(const FS_FILE *file, void *ctx) {
+    RESULT *result = ctx;
+    size_t used = strlen(result->names);
+    snprintf(result->names + used, sizeof(result->names) - used, "%s%s", used ? " " : "", file->filename);
+    result->seen++;
+    return result->limit == 0 || result->seen < result->limit;
+}
+
+static void expect(const char *what, const FS_FILTER *filter, const char *names) {
+    RESULT result = { .names = "", .limit = 0 };
+    int count = fs_list(filter, collect, &result);
+    if (strcmp(result.names, names) != 0 || count != result.seen) {
+        fail("%s: listed \"%s\" (%d), expected \"%s\"", what, result.names, count, names);
+    }
+}
+
+static void check_keys(void) {
+    const struct { uint32_t before, after; const char *what; } order[] = {
+        { key(2024, 2, 1, 10, 59, 59), key(2024, 2, 1, 11, 0, 0), "hour" },
+        { key(2024, 1, 31, 23, 59, 59), key(2024, 2, 1, 0, 0, 0), "month" },
+        { key(2023, 12, 31, 23, 59, 59), key(2024, 1, 1, 0, 0, 0), "year" },
+        { key(2000, 1, 1, 0, 0, 0), key(2063, 12, 31, 23, 59, 59), "range" },
+    };
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        if (!(order[i].before < order[i].after)) {
+            fail("fs_time_key does not order across the %s boundary", order[i].what);
+        }
+    }
+    if (key(1999, 6, 1, 0, 0, 0) != key(2000, 6, 1, 0, 0, 0) || key(2070, 6, 1, 0, 0, 0) != key(2063, 6, 1, 0, 0, 0)) {
+        fail("fs_time_key does not clamp years outside 2000-2063");
+    }
+}
+
+int main(void) {
+    // The filesystem reports progress on stdout; keep the test output readable.
+    freopen("/dev/null", "w", stdout);
+
+    flash_host_attach(image, sizeof(image));
+#ifdef FS_STATIC_MEMORY
+    fs_mount_arena(arena, sizeof(arena));
+    fs_init();
+    fat_init();
+    fat = fs_mount_arena(arena, sizeof(arena));
+#else
+    fs_init();
+    fat_init();
+    fat = &fat_storage;
+    fat_read(fat);
+    fs_mount(fat);
+#endif
+
+    check_keys();
+
+    // Created out of time order, so the listing has to come from the index, not the slots.
+    create("d", "bin", at(2024, 2, 1, 0, 0, 0));
+    FS_FILE *a = create("a", "log", at(2023, 12, 31, 23, 59, 59));
+    FS_FILE *f = create("f", "log", at(2024, 2, 1, 11, 0, 0));
+    create("b", "bin", at(2024, 1, 1, 0, 0, 0));
+    FS_FILE *e = create("e", "bin", at(2024, 2, 1, 10, 59, 59));
+    FS_FILE *c = create("c", "log", at(2024, 1, 31, 23, 59, 59));
+    if (a == NULL || c == NULL || e == NULL || f == NULL) {
+        return 1;
+    }
+    e->attributes = 0x01;
+    f->attributes = 0x03;
+
+    expect("everything", NULL, "a b c d e f");
+
+    FS_FILTER range = { .time_field = FS_TIME_CREATE, .from = key(2024, 1, 1, 0, 0, 0), .to = key(2024, 2, 1, 0, 0, 0) };
+    expect("inclusive range", &range, "b c d");
+    range.from++;
+    range.to--;
+    expect("exclusive of both ends", &range, "c");
+    range.from = key(2024, 2, 1, 11, 0, 0);
+    range.to = FS_TIME_MAX;
+    expect("open-ended range", &range, "f");
+    range.from = key(2025, 1, 1, 0, 0, 0);
+    expect("empty range", &range, "");
+
+    FS_FILTER ext = { .time_field = FS_TIME_CREATE, .from = 0, .to = FS_TIME_MAX, .extension = "log" };
+    expect("extension", &ext, "a c f");
+    ext.from = key(2024, 1, 1, 0, 0, 0);
+    expect("extension in range", &ext, "c f");
+
+    FS_FILTER attr = { .time_field = FS_TIME_CREATE, .from = 0, .to = FS_TIME_MAX, .attr_mask = 0x01, .attr_value = 0x01 };
+    expect("attribute set", &attr, "e f");
+    attr.attr_mask = 0x03;
+    expect("attribute pair", &attr, "e");
+    attr.attr_value = 0;
+    expect("attributes clear", &attr, "a b c d");
+
+    RESULT first_two = { .names = "", .limit = 2 };
+    if (fs_list(NULL, collect, &first_two) != 2 || strcmp(first_two.names, "a b") != 0) {
+        fail("early stop: listed \"%s\", expected \"a b\"", first_two.names);
+    }
+
+    // Writing a moves it to the end of the modify index and leaves the create index alone.
+    datetime_t later = at(2025, 3, 1, 12, 0, 0);
+    rtc_set_datetime(&later);
+    if (fs_write(a, (const uint8_t *)"hello", 5) != 5) {
+        fail("write of a.log failed");
+    }
+    FS_FILTER modified = { .time_field = FS_TIME_MODIFY, .from = key(2025, 1, 1, 0, 0, 0), .to = FS_TIME_MAX };
+    expect("modify range after write", &modified, "a");
+    modified.from = 0;
+    expect("modify order after write", &modified, "b c d e f a");
+    expect("create order after write", NULL, "a b c d e f");
+
+    // Deleting c drops it from both indexes; its slot goes to a new file in its own place.
+    if (fs_delete(fat, c) != 0) {
+        fail("delete of c.log failed");
+    }
+    expect("create order after delete", NULL, "a b d e f");
+    expect("modify order after delete", &modified, "b d e f a");
+    create("g", "bin", at(2024, 1, 15, 8, 0, 0));
+    expect("create order after reuse", NULL, "a b g d e f");
+    range.from = key(2024, 1, 1, 0, 0, 0);
+    range.to = key(2024, 1, 31, 23, 59, 59);
+    expect("range after reuse", &range, "b g");
+
+    fprintf(stderr, "query: %d failures\n", failures);
+    return failures ? 1 : 0;
+}
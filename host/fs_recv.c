@@ -0,0 +1,408 @@
+#include "fs_export.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// Host side of the bulk export protocol (fs_export.h). Talks to the board's USB serial port
+// or to any command that speaks the protocol on its stdin/stdout, such as fs_serve.
+//
+//   fs_recv -d /dev/ttyACM0 list
+//   fs_recv -d /dev/ttyACM0 get NAME.EXT [OUT]
+//   fs_recv -d /dev/ttyACM0 dump OUT
+//   fs_recv -e "./fs_serve volume.img" get NAME.EXT [OUT]
+//
+// get and dump append to OUT and start from its current size, so an interrupted transfer is
+// resumed by running the same command again. get keeps the file's size and create/modify keys
+// in OUT.part while OUT is incomplete and only resumes if the board still has that version;
+// without a matching OUT.part it starts over. Within a run, a frame that fails its CRC, goes
+// missing or is cut short by 'X' changed is asked for again from the last good byte.
+
+#define RETRIES 20
+#define TIMEOUT_MS 3000
+
+static int link_in = -1, link_out = -1;
+static uint8_t frame_buf[FS_EXPORT_CHUNK + 64];
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// Runs command through the shell with its stdin and stdout connected to us.
+static void open_command(const char *command) {
+    int to_child[2], from_child[2];
+    if (pipe(to_child) != 0 || pipe(from_child) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    if (fork() == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[1]);
+        close(from_child[0]);
+        execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+        _exit(127);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    link_out = to_child[1];
+    link_in = from_child[0];
+    signal(SIGPIPE, SIG_IGN);
+}
+
+// Opens the board's CDC ACM port raw: no echo, no line editing, no newline translation.
+static void open_device(const char *path) {
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if (fd < 0 || tcgetattr(fd, &tio) != 0) {
+        perror(path);
+        exit(1);
+    }
+    cfmakeraw(&tio);
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &tio);
+    tcflush(fd, TCIOFLUSH);
+    link_in = link_out = fd;
+}
+
+// Reads exactly len bytes. Returns 1, 0 on timeout, or -1 once the link is gone.
+static int read_exact(uint8_t *buf, uint32_t len) {
+    while (len > 0) {
+        struct pollfd pfd = { .fd = link_in, .events = POLLIN };
+        int ready = poll(&pfd, 1, TIMEOUT_MS);
+        if (ready == 0) {
+            return 0;
+        }
+        ssize_t n = ready > 0 ? read(link_in, buf, len) : -1;
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static void send_request(uint8_t type, const uint8_t *payload, uint32_t len) {
+    uint8_t header[FS_EXPORT_HEADER_SIZE] = { FS_EXPORT_MAGIC0, FS_EXPORT_MAGIC1, type, 0 };
+    uint8_t trailer[4];
+    put32(header + 4, len);
+    put32(trailer, fs_crc32(fs_crc32(0, header + 2, sizeof(header) - 2), payload, len));
+
+    if (write(link_out, header, sizeof(header)) != sizeof(header) ||
+        write(link_out, payload, len) != (ssize_t)len ||
+        write(link_out, trailer, sizeof(trailer)) != sizeof(trailer)) {
+        fprintf(stderr, "Error: link closed\n");
+        exit(1);
+    }
+}
+
+#define FRAME_GOOD 1
+#define FRAME_BAD 0         // Failed its CRC.
+#define FRAME_TIMEOUT -1    // Nothing more arrived.
+#define FRAME_CLOSED -2     // The link is gone.
+
+// Reads the next frame into frame_buf, skipping anything that is not one.
+static int read_frame(uint8_t *type, uint32_t *len) {
+    uint8_t header[FS_EXPORT_HEADER_SIZE];
+    int r;
+    for (;;) {
+        if ((r = read_exact(header, 1)) < 1) {
+            break;
+        }
+        if (header[0] != FS_EXPORT_MAGIC0) {
+            continue;
+        }
+        if ((r = read_exact(header + 1, 1)) < 1) {
+            break;
+        }
+        if (header[1] != FS_EXPORT_MAGIC1) {
+            continue;
+        }
+        if ((r = read_exact(header + 2, sizeof(header) - 2)) < 1) {
+            break;
+        }
+
+        *type = header[2];
+        *len = get32(header + 4);
+        if (*len > sizeof(frame_buf) - 4) {
+            continue;  // Not a real header.
+        }
+        if ((r = read_exact(frame_buf, *len + 4)) < 1) {
+            break;
+        }
+        uint32_t crc = fs_crc32(fs_crc32(0, header + 2, sizeof(header) - 2), frame_buf, *len);
+        return crc == get32(frame_buf + *len) ? FRAME_GOOD : FRAME_BAD;
+    }
+    return r == 0 ? FRAME_TIMEOUT : FRAME_CLOSED;
+}
+
+// True for the frames that end a response.
+static bool is_last(int r, uint8_t type) {
+    return r == FRAME_GOOD && (type == FS_EXPORT_DONE || type == FS_EXPORT_ERROR);
+}
+
+static void print_entry(const uint8_t *p, uint32_t len) {
+    if (len < 15 || 14u + p[13] >= len) {
+        return;
+    }
+    uint8_t name_len = p[13];
+    uint8_t ext_len = p[14 + name_len];
+    uint32_t key = get32(p + 4);
+    printf("%04u-%02u-%02u %02u:%02u:%02u %10u  %.*s.%.*s\n",
+           2000 + (key >> 26), (key >> 22) & 15, (key >> 17) & 31, (key >> 12) & 31, (key >> 6) & 63, key & 63,
+           get32(p), name_len, (const char *)p + 14, ext_len, (const char *)p + 15 + name_len);
+}
+
+static int do_list(void) {
+    // Entries are held until 'Z' so a retried listing does not print twice.
+    static uint8_t entries[MAX_FILES][FS_EXPORT_MAX_REQUEST + 16];
+    static uint32_t entry_len[MAX_FILES];
+
+    for (int attempt = 0; attempt < RETRIES; attempt++) {
+        send_request(FS_EXPORT_LIST, NULL, 0);
+        int count = 0;
+        bool damaged = false;
+        uint8_t type;
+        uint32_t len;
+        int r;
+        while ((r = read_frame(&type, &len)) >= FRAME_BAD && !is_last(r, type)) {
+            if (r == FRAME_BAD) {
+                damaged = true;
+            } else if (type == FS_EXPORT_ENTRY && count < MAX_FILES && len <= sizeof(entries[0])) {
+                memcpy(entries[count], frame_buf, len);
+                entry_len[count++] = len;
+            }
+        }
+        if (r == FRAME_CLOSED) {
+            fprintf(stderr, "Error: link closed\n");
+            return 1;
+        }
+        if (r == FRAME_GOOD && type == FS_EXPORT_DONE && !damaged && get32(frame_buf) == (uint32_t)count) {
+            for (int i = 0; i < count; i++) {
+                print_entry(entries[i], entry_len[i]);
+            }
+            printf("%d file(s)\n", count);
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error: listing failed after %d attempts\n", RETRIES);
+    return 1;
+}
+
+// OUT.part names the version of the file a partial OUT holds: "size create_key mod_key".
+static void part_path(const char *out_path, char *path, size_t size) {
+    snprintf(path, size, "%s.part", out_path);
+}
+
+static bool read_part(const char *out_path, uint32_t *total, uint32_t *create_key, uint32_t *mod_key) {
+    char path[4096];
+    part_path(out_path, path, sizeof(path));
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+    bool ok = fscanf(f, "%u %u %u", total, create_key, mod_key) == 3;
+    fclose(f);
+    return ok;
+}
+
+static bool write_part(const char *out_path, uint32_t total, uint32_t create_key, uint32_t mod_key) {
+    char path[4096];
+    part_path(out_path, path, sizeof(path));
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    fprintf(f, "%u %u %u\n", total, create_key, mod_key);
+    return fclose(f) == 0;
+}
+
+static void remove_part(const char *out_path) {
+    char path[4096];
+    part_path(out_path, path, sizeof(path));
+    unlink(path);
+}
+
+// Fetches bytes into out from its current size onwards with 'G' (file) or 'R' (raw volume).
+static int do_transfer(uint8_t request, const char *name, const char *out_path) {
+    int out = open(out_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    struct stat st;
+    if (out < 0 || fstat(out, &st) != 0) {
+        perror(out_path);
+        return 1;
+    }
+    uint32_t offset = st.st_size, start = offset;
+    uint32_t total = request == FS_EXPORT_RAW ? FS_VOLUME_SIZE : 0;
+    uint32_t create_key = 0, mod_key = 0;
+    bool have_entry = false;
+    struct timespec t0, t1;
+
+    // Bytes already in OUT are only kept if OUT.part says which version of the file they are;
+    // the first entry frame is then checked against it like any later one.
+    if (request == FS_EXPORT_GET && offset > 0) {
+        have_entry = read_part(out_path, &total, &create_key, &mod_key) && offset <= total;
+        if (!have_entry) {
+            fprintf(stderr, "%s has no matching %s.part, starting over\n", out_path, out_path);
+            if (ftruncate(out, 0) != 0) {
+                perror(out_path);
+                close(out);
+                return 1;
+            }
+            offset = start = 0;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for (int attempt = 0; attempt < RETRIES; attempt++) {
+        uint8_t payload[8 + MAX_FILENAME_LENGTH + MAX_EXTENSION_LENGTH + 2];
+        uint32_t payload_len;
+        put32(payload, offset);
+        if (request == FS_EXPORT_RAW) {
+            if (offset >= FS_VOLUME_SIZE) {
+                break;
+            }
+            put32(payload + 4, FS_VOLUME_SIZE - offset);
+            payload_len = 8;
+        } else {
+            payload_len = 4 + strlen(name);
+            memcpy(payload + 4, name, payload_len - 4);
+        }
+        send_request(request, payload, payload_len);
+
+        // Take frames in order; once one is lost, ignore data until the response ends.
+        bool synced = true, replaced = false;
+        uint8_t type;
+        uint32_t len;
+        int r;
+        while ((r = read_frame(&type, &len)) >= FRAME_BAD && !is_last(r, type)) {
+            if (r == FRAME_BAD) {
+                synced = false;
+            } else if (type == FS_EXPORT_ENTRY && len >= 12) {
+                // A different file under the same name: what we have is useless.
+                if (have_entry && (get32(frame_buf) != total || get32(frame_buf + 4) != create_key ||
+                                   get32(frame_buf + 8) != mod_key)) {
+                    replaced = true;
+                    synced = false;
+                    continue;
+                }
+                if (!have_entry) {
+                    total = get32(frame_buf);
+                    create_key = get32(frame_buf + 4);
+                    mod_key = get32(frame_buf + 8);
+                    have_entry = true;
+                    if (!write_part(out_path, total, create_key, mod_key)) {
+                        close(out);
+                        return 1;
+                    }
+                }
+            } else if (type == FS_EXPORT_DATA && len >= 4 && synced && get32(frame_buf) == offset) {
+                if (write(out, frame_buf + 4, len - 4) != (ssize_t)(len - 4)) {
+                    perror(out_path);
+                    close(out);
+                    return 1;
+                }
+                offset += len - 4;
+            } else if (type == FS_EXPORT_DATA) {
+                synced = false;
+            }
+        }
+
+        if (r == FRAME_CLOSED) {
+            fprintf(stderr, "Error: link closed at byte %u\n", offset);
+            close(out);
+            return 1;
+        }
+        if (r == FRAME_GOOD && type == FS_EXPORT_ERROR && len >= 1 && frame_buf[0] != FS_EXPORT_CHANGED) {
+            fprintf(stderr, "Error: %.*s\n", (int)len - 1, (const char *)frame_buf + 1);
+            close(out);
+            return 1;
+        }
+        if (replaced) {
+            fprintf(stderr, "%s was replaced, starting over\n", name);
+            if (ftruncate(out, 0) != 0) {
+                perror(out_path);
+            }
+            offset = start = 0;
+            have_entry = false;
+            continue;
+        }
+        if (have_entry && offset == total) {
+            break;
+        }
+    }
+    close(out);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (!(have_entry || request == FS_EXPORT_RAW) || offset != total) {
+        fprintf(stderr, "Error: stopped at byte %u of %u, run again to resume\n", offset, total);
+        return 1;
+    }
+    if (request == FS_EXPORT_GET) {
+        remove_part(out_path);
+    }
+    fprintf(stderr, "%u bytes (%u new) in %.2f s, %.0f KB/s\n", total, offset - start, secs,
+            secs > 0 ? (offset - start) / 1024.0 / secs : 0.0);
+    return 0;
+}
+
+static int usage(const char *prog) {
+    fprintf(stderr, "usage: %s (-d DEVICE | -e COMMAND) list | get NAME.EXT [OUT] | dump OUT\n", prog);
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:e:")) != -1) {
+        if (opt == 'd') {
+            open_device(optarg);
+        } else if (opt == 'e') {
+            open_command(optarg);
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (link_in < 0 || optind >= argc) {
+        return usage(argv[0]);
+    }
+
+    const char *cmd = argv[optind];
+    int status;
+    if (strcmp(cmd, "list") == 0) {
+        status = do_list();
+    } else if (strcmp(cmd, "get") == 0 && optind + 1 < argc) {
+        status = do_transfer(FS_EXPORT_GET, argv[optind + 1], optind + 2 < argc ? argv[optind + 2] : argv[optind + 1]);
+    } else if (strcmp(cmd, "dump") == 0 && optind + 1 < argc) {
+        status = do_transfer(FS_EXPORT_RAW, NULL, argv[optind + 1]);
+    } else {
+        return usage(argv[0]);
+    }
+
+    close(link_out);
+    if (link_in != link_out) {
+        close(link_in);
+    }
+    wait(NULL);
+    return status;
+}
@@ -0,0 +1,93 @@
+#include "filesystem.h"
+#include "fs_export.h"
+#include "flash_host.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Serves a filesystem image over stdin/stdout with the same export code the board runs on
+// USB, so fs_recv can be exercised over a pipe:
+//
+//   fs_recv -e "./fs_serve volume.img" get log.txt log.txt
+//
+// The image is mapped read-write. A missing or short image is created and formatted.
+// The filesystem's own printf chatter goes to stderr; stdout carries frames only.
+//
+// Usage: fs_serve IMAGE
+
+#ifdef FS_STATIC_MEMORY
+static uint8_t arena[FS_ARENA_SIZE(FS_CACHE_SLOTS)] __attribute__((aligned(8)));
+#else
+static FATable fat_storage;
+#endif
+
+static int pipe_read(void *ctx, uint8_t *buf, uint32_t len) {
+    (void)ctx;
+    return read(STDIN_FILENO, buf, len);
+}
+
+static bool pipe_write(void *ctx, const uint8_t *data, uint32_t len) {
+    return fwrite(data, 1, len, ctx) == len;
+}
+
+static void pipe_flush(void *ctx) {
+    fflush(ctx);
+}
+
+static FATable *mount(void) {
+#ifdef FS_STATIC_MEMORY
+    return fs_mount_arena(arena, sizeof(arena));
+#else
+    fat_read(&fat_storage);
+    fs_mount(&fat_storage);
+    return &fat_storage;
+#endif
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s IMAGE\n", argv[0]);
+        return 2;
+    }
+
+    // Keep stdout for frames and send everything printf'd to stderr.
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    static char out_buf[64 * 1024];
+    setvbuf(out, out_buf, _IOFBF, sizeof(out_buf));
+
+    int fd = open(argv[1], O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    bool fresh = st.st_size < (off_t)FS_VOLUME_SIZE;
+    if (fresh && ftruncate(fd, FS_VOLUME_SIZE) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    uint8_t *image = mmap(NULL, FS_VOLUME_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    flash_host_attach(image, FS_VOLUME_SIZE);
+
+    FATable *fat = mount();
+    if (fresh) {
+        fs_init();
+        fat_init();
+        fat = mount();
+    }
+
+    FS_EXPORT_IO io = { pipe_read, pipe_write, pipe_flush, out };
+    fs_export_serve(&io, fat);
+
+    munmap(image, FS_VOLUME_SIZE);
+    close(fd);
+    return 0;
+}
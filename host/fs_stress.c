@@ -0,0 +1,282 @@
+#include "filesystem.h"
+#include "flash_host.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Multi-threaded stress test for the single-writer / lock-free-reader model.
+// One writer thread creates, writes and deletes files the way the radio core would while
+// reader threads list, stat and read them the way the USB core would. Every file's content
+// names the file it belongs to, so a reader can tell a torn or mixed-up read from a clean one.
+// Files alternate between 2020 and 2030 and every third one is a .log, and readers also run a
+// filtered listing, so an entry whose slot was reused mid-listing shows up as a wrong match.
+//
+// Usage: fs_stress [writer_ops] [readers]
+
+#define LIVE_FILES 40
+
+static uint8_t image[FS_VOLUME_SIZE];
+static FATable *fat;
+#ifdef FS_STATIC_MEMORY
+static uint8_t arena[FS_ARENA_SIZE(FS_CACHE_SLOTS)] __attribute__((aligned(8)));
+#else
+static FATable fat_storage;
+#endif
+static atomic_bool writer_done;
+static atomic_uint next_k;
+static atomic_ulong lists_done, reads_done, reads_missed;
+static atomic_int failures;
+
+static uint32_t file_size(uint32_t k) {
+    return 4 + (k * 977) % 5000;
+}
+
+static uint8_t file_byte(uint32_t k, uint32_t i) {
+    return (uint8_t)(k * 31 + i * 7);
+}
+
+static void fail(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "FAIL: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    atomic_fetch_add(&failures, 1);
+}
+
+// Content is the file number followed by a pattern derived from it.
+static void fill(uint32_t k, uint8_t *buf) {
+    memcpy(buf, &k, 4);
+    for (uint32_t i = 4; i < file_size(k); i++) {
+        buf[i] = file_byte(k, i);
+    }
+}
+
+static bool check_content(const uint8_t *buf, uint32_t len) {
+    uint32_t k;
+    if (len < 4) {
+        return false;
+    }
+    memcpy(&k, buf, 4);
+    if (len != file_size(k)) {
+        return false;
+    }
+    for (uint32_t i = 4; i < len; i++) {
+        if (buf[i] != file_byte(k, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Files are stamped in 2020 or 2030 and get a .log or .bin extension by number.
+static int file_year(uint32_t k) {
+    return k % 2 == 0 ? 2020 : 2030;
+}
+
+static const char *file_extension(uint32_t k) {
+    return k % 3 == 0 ? "log" : "bin";
+}
+
+static bool check_entry(const FS_FILE *file, void *ctx) {
+    unsigned k;
+    (void)ctx;
+    if (sscanf(file->filename, "f%u", &k) != 1 || strcmp(file->extension, file_extension(k)) != 0) {
+        fail("listed a garbage entry '%.16s.%.8s'", file->filename, file->extension);
+    } else if (file->size != 0 && file->size != file_size(k)) {
+        fail("entry f%u has size %u, expected 0 or %u", k, file->size, file_size(k));
+    } else if (fs_time_key(&file->create_datetime) > fs_time_key(&file->last_mod_datetime)) {
+        fail("entry f%u modified before it was created", k);
+    }
+    return true;
+}
+
+// Every entry a filtered listing hands back has to satisfy the filter.
+static bool check_filtered(const FS_FILE *file, void *ctx) {
+    const FS_FILTER *filter = ctx;
+    uint32_t key = fs_time_key(&file->create_datetime);
+    if (key < filter->from || key > filter->to || strcmp(file->extension, filter->extension) != 0) {
+        fail("filtered listing returned '%.16s.%.8s' created %d", file->filename, file->extension,
+             file->create_datetime.year);
+    }
+    return check_entry(file, NULL);
+}
+
+static void *reader(void *arg) {
+    unsigned seed = (unsigned)(uintptr_t)arg;
+    static _Thread_local uint8_t buf[8192];
+    char name[16];
+    datetime_t from = { .year = 2020, .month = 1, .day = 1 };
+    datetime_t to = { .year = 2020, .month = 12, .day = 31, .hour = 23, .min = 59, .sec = 59 };
+    FS_FILTER filter = { .time_field = FS_TIME_CREATE, .from = fs_time_key(&from), .to = fs_time_key(&to),
+                         .extension = "bin" };
+
+    while (!atomic_load(&writer_done)) {
+        fs_list(NULL, check_entry, NULL);
+        fs_list(&filter, check_filtered, &filter);
+        atomic_fetch_add(&lists_done, 1);
+
+        uint32_t newest = atomic_load(&next_k);
+        uint32_t k = newest - 1 - rand_r(&seed) % LIVE_FILES;
+        snprintf(name, sizeof(name), "f%u", k);
+
+        FS_FILE *file = fs_open(name, "rw", fat);
+        FS_FILE snapshot;
+        if (file == NULL || fs_stat(file, &snapshot) != 0 || snapshot.size == 0) {
+            atomic_fetch_add(&reads_missed, 1);
+            continue;
+        }
+
+        // The slot may be reused by another file before the read; the content still has to
+        // be exactly one whole file.
+        int n = fs_read_into(file, buf, 0, sizeof(buf));
+        if (n > 0 && !check_content(buf, n)) {
+            fail("read of %s returned %d inconsistent bytes", name, n);
+        }
+        atomic_fetch_add(&reads_done, 1);
+    }
+    return NULL;
+}
+
+static void *writer(void *arg) {
+    uint32_t ops = (uint32_t)(uintptr_t)arg;
+    static uint8_t buf[8192];
+    FS_FILE *live[LIVE_FILES] = { 0 };
+    char name[16];
+
+    for (uint32_t k = 0; k < ops; k++) {
+        FS_FILE **slot = &live[k % LIVE_FILES];
+        if (*slot != NULL && fs_delete(fat, *slot) != 0) {
+            fail("delete of f%u failed", k - LIVE_FILES);
+        }
+
+        datetime_t t = { .year = file_year(k), .month = 6, .day = 15, .hour = 12 };
+        rtc_set_datetime(&t);
+        snprintf(name, sizeof(name), "f%u", k);
+        *slot = fat_fs_new(fat, name, file_extension(k));
+        if (*slot == NULL) {
+            fail("create of %s failed", name);
+            break;
+        }
+        atomic_store(&next_k, k + 1);
+
+        fill(k, buf);
+        if (fs_write(*slot, buf, file_size(k)) != (int)file_size(k)) {
+            fail("write of %s failed", name);
+        }
+
+        if (k % 100 == 99) {
+            fat_write(fat);
+        }
+    }
+
+    atomic_store(&writer_done, true);
+    return NULL;
+}
+
+// With everything quiet, every chain must be intact and add up to free_count.
+static void check_final(void) {
+    static uint8_t owner[MAX_CLUSTERS];
+    static uint8_t buf[8192];
+    uint32_t used = 0;
+
+    memset(owner, 0, sizeof(owner));
+    for (int i = 0; i < MAX_FILES; i++) {
+        FS_FILE *file = &fat->entries[i];
+        if (file->filename[0] == '\0') {
+            continue;
+        }
+
+        uint16_t cluster_id = file->first_cluster;
+        uint32_t clusters = (file->size + CLUSTER_DATA_SIZE - 1) / CLUSTER_DATA_SIZE;
+        for (uint32_t c = 0; c < clusters; c++) {
+            if (cluster_id >= MAX_CLUSTERS) {
+                fail("%s: chain ends after %u of %u clusters", file->filename, c, clusters);
+                break;
+            }
+            if (owner[cluster_id]++) {
+                fail("%s: cluster %u is cross-linked", file->filename, cluster_id);
+            }
+            const CLUSTER *cluster = (const CLUSTER *)(image + DATA_SECTOR_OFFSET(0)) + cluster_id;
+            cluster_id = cluster->next_cluster;
+            used++;
+        }
+        if (cluster_id != CLUSTER_EOF && clusters > 0) {
+            fail("%s: chain is not terminated", file->filename);
+        }
+
+        int n = fs_read_into(file, buf, 0, sizeof(buf));
+        if (n != (int)file->size || !check_content(buf, n)) {
+            fail("%s: final read returned %d bad bytes", file->filename, n);
+        }
+        uint32_t k;
+        memcpy(&k, buf, 4);
+        n = fs_read_into(file, buf, 1000, 100);
+        for (int b = 0; b < n; b++) {
+            if (buf[b] != file_byte(k, 1000 + b)) {
+                fail("%s: offset read mismatch at %d", file->filename, 1000 + b);
+                break;
+            }
+        }
+    }
+
+    for (uint32_t id = 0; id < MAX_CLUSTERS; id++) {
+        const CLUSTER *cluster = (const CLUSTER *)(image + DATA_SECTOR_OFFSET(0)) + id;
+        if (!owner[id] && cluster->next_cluster != CLUSTER_FREE) {
+            fail("cluster %u is leaked", id);
+        }
+    }
+    if (fat->free_count != MAX_CLUSTERS - used) {
+        fail("free_count is %u, chains use %u of %u", fat->free_count, used, MAX_CLUSTERS);
+    }
+}
+
+int main(int argc, char **argv) {
+    uint32_t ops = argc > 1 ? strtoul(argv[1], NULL, 0) : 2000;
+    int readers = argc > 2 ? atoi(argv[2]) : 3;
+    pthread_t threads[16];
+
+    if (readers < 1 || readers > 16) {
+        fprintf(stderr, "readers must be 1..16\n");
+        return 2;
+    }
+
+    // The filesystem reports progress on stdout; keep the test output readable.
+    freopen("/dev/null", "w", stdout);
+
+    flash_host_attach(image, sizeof(image));
+#ifdef FS_STATIC_MEMORY
+    fs_mount_arena(arena, sizeof(arena));
+    fs_init();
+    fat_init();
+    fat = fs_mount_arena(arena, sizeof(arena));
+#else
+    fs_init();
+    fat_init();
+    fat = &fat_storage;
+    fat_read(fat);
+    fs_mount(fat);
+#endif
+
+    pthread_t writer_thread;
+    pthread_create(&writer_thread, NULL, writer, (void *)(uintptr_t)ops);
+    for (int i = 0; i < readers; i++) {
+        pthread_create(&threads[i], NULL, reader, (void *)(uintptr_t)(i + 1));
+    }
+
+    pthread_join(writer_thread, NULL);
+    for (int i = 0; i < readers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    check_final();
+
+    fprintf(stderr, "%u writer ops, %d readers: %lu lists, %lu reads (%lu missed), %d failures\n",
+            ops, readers, atomic_load(&lists_done), atomic_load(&reads_done),
+            atomic_load(&reads_missed), atomic_load(&failures));
+    return atomic_load(&failures) ? 1 : 0;
+}
@@ -0,0 +1,467 @@
+#include "filesystem.h"
+#include "flash_host.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Offline tool for filesystem images, built from the same filesystem.c the board runs.
+// The image is mmap'd and stands in for the flash, so images made here can be written to
+// the board's filesystem region as they are, and images read back from a board (fs_recv
+// dump, or picotool) can be inspected without one.
+//
+// Usage:
+//   fsimg mkfs IMAGE [FILE...]       Create a formatted image, optionally loaded with files.
+//   fsimg add IMAGE FILE...          Add files to an existing image.
+//   fsimg ls IMAGE                   List files, oldest first.
+//   fsimg get IMAGE NAME.EXT [OUT]   Extract one file (OUT "-" or missing: NAME.EXT).
+//   fsimg extract IMAGE DIR          Extract every file into DIR.
+//   fsimg dump IMAGE                 Print every entry with its cluster chain.
+//   fsimg fsck IMAGE                 Check the table and chains, exit 1 if anything is wrong.
+//
+// Added files are stamped with their modification time. -v before the command shows the
+// filesystem's own debug output.
+
+#ifdef FS_STATIC_MEMORY
+static uint8_t arena[FS_ARENA_SIZE(FS_CACHE_SLOTS)] __attribute__((aligned(8)));
+#else
+static FATable fat_storage;
+#endif
+
+static uint8_t *image;
+static FILE *out;       // The real stdout; the filesystem's printf goes elsewhere.
+
+static FATable *mount(void) {
+#ifdef FS_STATIC_MEMORY
+    return fs_mount_arena(arena, sizeof(arena));
+#else
+    fat_read(&fat_storage);
+    fs_mount(&fat_storage);
+    return &fat_storage;
+#endif
+}
+
+#define IMAGE_READ 0
+#define IMAGE_WRITE 1
+#define IMAGE_CREATE 2
+
+// Maps the image. IMAGE_CREATE makes a new, unformatted one of FS_VOLUME_SIZE bytes;
+// IMAGE_READ maps it read-only so inspecting a field return cannot change it.
+static int open_image(const char *path, int mode) {
+    bool create = mode == IMAGE_CREATE;
+    int fd = open(path, mode == IMAGE_READ ? O_RDONLY : create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    struct stat st;
+    if (fd < 0 || (create && ftruncate(fd, FS_VOLUME_SIZE) != 0) || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (st.st_size < (off_t)FS_VOLUME_SIZE) {
+        fprintf(stderr, "Error: %s is %lld bytes, a volume is %u\n", path, (long long)st.st_size, (unsigned)FS_VOLUME_SIZE);
+        close(fd);
+        return -1;
+    }
+
+    int prot = mode == IMAGE_READ ? PROT_READ : PROT_READ | PROT_WRITE;
+    image = mmap(NULL, FS_VOLUME_SIZE, prot, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    flash_host_attach(image, FS_VOLUME_SIZE);
+    return 0;
+}
+
+static void close_image(void) {
+    msync(image, FS_VOLUME_SIZE, MS_SYNC);  // No-op for a read-only mapping.
+    munmap(image, FS_VOLUME_SIZE);
+}
+
+// Finds "name.ext" among the mounted entries.
+static FS_FILE *find_file(FATable *fat, const char *name) {
+    const char *dot = strrchr(name, '.');
+    size_t stem = dot != NULL ? (size_t)(dot - name) : strlen(name);
+    const char *ext = dot != NULL ? dot + 1 : "";
+
+    for (int i = 0; i < MAX_FILES; i++) {
+        FS_FILE *file = &fat->entries[i];
+        if (file->filename[0] != '\0' && strnlen(file->filename, MAX_FILENAME_LENGTH) == stem &&
+            strncmp(file->filename, name, stem) == 0 && strncmp(file->extension, ext, MAX_EXTENSION_LENGTH) == 0) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+// Loads one host file into the image as basename(path), stamped with its mtime.
+static int add_file(FATable *fat, const char *path) {
+    char base[MAX_FILENAME_LENGTH + MAX_EXTENSION_LENGTH + 2];
+    char copy[4096];
+    snprintf(copy, sizeof(copy), "%s", path);
+    const char *name = basename(copy);
+
+    const char *dot = strrchr(name, '.');
+    size_t stem = dot != NULL ? (size_t)(dot - name) : strlen(name);
+    const char *ext = dot != NULL ? dot + 1 : "";
+    if (stem == 0 || stem >= MAX_FILENAME_LENGTH || strlen(ext) >= MAX_EXTENSION_LENGTH) {
+        fprintf(stderr, "Error: %s: name must be 1-%d characters with an extension under %d\n",
+                path, MAX_FILENAME_LENGTH - 1, MAX_EXTENSION_LENGTH);
+        return -1;
+    }
+    snprintf(base, sizeof(base), "%.*s", (int)stem, name);
+    if (find_file(fat, name) != NULL) {
+        fprintf(stderr, "Error: %s is already in the image\n", name);
+        return -1;
+    }
+
+    FILE *in = fopen(path, "rb");
+    struct stat st;
+    if (in == NULL || fstat(fileno(in), &st) != 0) {
+        fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    uint32_t clusters = (st.st_size + CLUSTER_DATA_SIZE - 1) / CLUSTER_DATA_SIZE;
+    if (clusters > fat->free_count) {
+        fprintf(stderr, "Error: %s needs %u clusters, %u free\n", path, clusters, fat->free_count);
+        fclose(in);
+        return -1;
+    }
+
+    uint8_t *data = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (data == NULL || fread(data, 1, st.st_size, in) != (size_t)st.st_size) {
+        fprintf(stderr, "Error: reading %s\n", path);
+        free(data);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+
+    // The filesystem stamps files from the RTC; pin it to the file's own time.
+    struct tm tm;
+    localtime_r(&st.st_mtime, &tm);
+    datetime_t t = {
+        .year = tm.tm_year + 1900, .month = tm.tm_mon + 1, .day = tm.tm_mday, .dotw = tm.tm_wday,
+        .hour = tm.tm_hour, .min = tm.tm_min, .sec = tm.tm_sec
+    };
+    rtc_set_datetime(&t);
+
+    FS_FILE *file = fat_fs_new(fat, base, ext);
+    int status = file != NULL ? 0 : -1;
+    if (file != NULL && st.st_size > 0 && fs_write(file, data, st.st_size) != st.st_size) {
+        status = -1;
+    }
+    if (status != 0) {
+        fprintf(stderr, "Error: could not add %s\n", path);
+    }
+    free(data);
+    return status;
+}
+
+static int add_files(FATable *fat, int count, char **paths) {
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        failed |= add_file(fat, paths[i]) != 0;
+    }
+    fat_write(fat);
+    return failed;
+}
+
+// Says what is wrong with an entry's name as a host file name, or NULL if it is safe to
+// write out under a directory: terminated, and no '/' or ".." to climb out of it.
+static const char *name_problem(const FS_FILE *file) {
+    if (memchr(file->filename, '\0', MAX_FILENAME_LENGTH) == NULL ||
+        memchr(file->extension, '\0', MAX_EXTENSION_LENGTH) == NULL) {
+        return "name is not terminated";
+    }
+    if (strchr(file->filename, '/') != NULL || strchr(file->extension, '/') != NULL) {
+        return "name contains '/'";
+    }
+    if (strstr(file->filename, "..") != NULL || strstr(file->extension, "..") != NULL) {
+        return "name contains \"..\"";
+    }
+    return NULL;
+}
+
+// Prints one entry for ls. Names are bounded by their fields, and a bad one is flagged, since
+// ls is often the first look at a damaged image.
+static bool print_entry(const FS_FILE *file, void *ctx) {
+    (void)ctx;
+    const datetime_t *c = &file->create_datetime;
+    const char *problem = name_problem(file);
+    fprintf(out, "%04d-%02d-%02d %02d:%02d:%02d %10u  %.*s.%.*s%s%s\n",
+            c->year, c->month, c->day, c->hour, c->min, c->sec, file->size, MAX_FILENAME_LENGTH, file->filename,
+            MAX_EXTENSION_LENGTH, file->extension, problem != NULL ? "  <- " : "", problem != NULL ? problem : "");
+    return true;
+}
+
+// Writes one file out through fs_read_into, to stdout for "-".
+static int get_file(const FS_FILE *file, const char *path) {
+    uint8_t *data = malloc(file->size > 0 ? file->size : 1);
+    int n = data != NULL ? fs_read_into(file, data, 0, file->size) : -1;
+    if (n != (int)file->size) {
+        fprintf(stderr, "Error: %.*s.%.*s: chain is broken, run fsck\n", MAX_FILENAME_LENGTH, file->filename,
+                MAX_EXTENSION_LENGTH, file->extension);
+        free(data);
+        return -1;
+    }
+
+    FILE *f = strcmp(path, "-") == 0 ? out : fopen(path, "wb");
+    if (f == NULL || fwrite(data, 1, n, f) != (size_t)n) {
+        fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+        free(data);
+        return -1;
+    }
+    if (f != out) {
+        fclose(f);
+    }
+    free(data);
+    return 0;
+}
+
+static int extract_all(FATable *fat, const char *dir) {
+    int failed = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        const FS_FILE *file = &fat->entries[i];
+        if (file->filename[0] == '\0') {
+            continue;
+        }
+        const char *problem = name_problem(file);
+        if (problem != NULL) {
+            fprintf(stderr, "Error: entry %d: %s, not extracted\n", i, problem);
+            failed = 1;
+            continue;
+        }
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s.%s", dir, file->filename, file->extension);
+        failed |= get_file(file, path) != 0;
+    }
+    return failed;
+}
+
+// The image's cluster headers, read in place.
+static const CLUSTER *clusters(void) {
+    return (const CLUSTER *)(image + DATA_SECTOR_OFFSET(0));
+}
+
+// Prints cluster ids as runs, e.g. "12-40 77 80-81".
+static void print_runs(const uint16_t *ids, uint32_t count) {
+    for (uint32_t i = 0; i < count; ) {
+        uint32_t j = i;
+        while (j + 1 < count && ids[j + 1] == ids[j] + 1) {
+            j++;
+        }
+        fprintf(out, j > i ? " %u-%u" : " %u", ids[i], ids[j]);
+        i = j + 1;
+    }
+}
+
+static int dump(const FATable *fat) {
+    static uint16_t chain[MAX_CLUSTERS];
+    for (int i = 0; i < MAX_FILES; i++) {
+        const FS_FILE *file = &fat->entries[i];
+        if (file->filename[0] == '\0') {
+            continue;
+        }
+
+        uint32_t length = 0;
+        uint16_t id = file->first_cluster;
+        while (id < MAX_CLUSTERS && length < MAX_CLUSTERS) {
+            chain[length++] = id;
+            id = clusters()[id].next_cluster;
+        }
+        fprintf(out, "[%2d] %.*s.%.*s size %u first %u, %u cluster(s):", i, MAX_FILENAME_LENGTH, file->filename,
+                MAX_EXTENSION_LENGTH, file->extension, file->size, file->first_cluster, length);
+        print_runs(chain, length);
+        fprintf(out, id == CLUSTER_EOF ? " EOF\n" : " -> 0x%04X\n", id);
+    }
+    fprintf(out, "free_count %u\n", fat->free_count);
+    return 0;
+}
+
+static int problems;
+static int16_t owner[MAX_CLUSTERS];     // Entry whose size accounts for each cluster, -1 for none.
+static bool reached[MAX_CLUSTERS];      // On some chain at all, even past a fault.
+
+// Marks the rest of a damaged chain as reachable so it is not also reported as leaked.
+static void mark_reached(uint16_t id) {
+    for (uint32_t steps = 0; id < MAX_CLUSTERS && !reached[id] && steps < MAX_CLUSTERS; steps++) {
+        reached[id] = true;
+        id = clusters()[id].next_cluster;
+    }
+}
+
+static void report(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(out, fmt, args);
+    fputc('\n', out);
+    va_end(args);
+    problems++;
+}
+
+// Checks the table and chains straight from the image, trusting nothing that mounting
+// would derive from them: every chain has exactly the clusters its size needs and ends in
+// EOF, no cluster is in two chains, every cluster in no chain is marked free, and
+// free_count matches.
+static int fsck(const FATable *fat) {
+    uint32_t used = 0, files = 0;
+
+    memset(owner, 0xFF, sizeof(owner));
+    memset(reached, 0, sizeof(reached));
+    for (int i = 0; i < MAX_FILES; i++) {
+        const FS_FILE *file = &fat->entries[i];
+        if (file->filename[0] == '\0') {
+            continue;
+        }
+        files++;
+
+        char name[MAX_FILENAME_LENGTH + MAX_EXTENSION_LENGTH + 8];
+        snprintf(name, sizeof(name), "[%d] %.*s.%.*s", i, MAX_FILENAME_LENGTH, file->filename,
+                 MAX_EXTENSION_LENGTH, file->extension);
+        const char *problem = name_problem(file);
+        if (problem != NULL) {
+            report("%s: %s", name, problem);
+        }
+        for (int j = 0; j < i; j++) {
+            const FS_FILE *other = &fat->entries[j];
+            if (other->filename[0] != '\0' && strncmp(other->filename, file->filename, MAX_FILENAME_LENGTH) == 0 &&
+                strncmp(other->extension, file->extension, MAX_EXTENSION_LENGTH) == 0) {
+                report("%s: same name as entry %d", name, j);
+            }
+        }
+
+        uint32_t expected = (file->size + CLUSTER_DATA_SIZE - 1) / CLUSTER_DATA_SIZE;
+        uint16_t id = file->first_cluster;
+        uint32_t length;
+        for (length = 0; length < expected; length++) {
+            if (id >= MAX_CLUSTERS) {
+                report("%s: chain ends after %u of %u clusters (next 0x%04X)", name, length, expected, id);
+                break;
+            }
+            if (owner[id] == i) {
+                report("%s: chain loops back to cluster %u", name, id);
+                break;
+            }
+            if (owner[id] >= 0) {
+                report("%s: cluster %u is cross-linked with entry %d", name, id, owner[id]);
+                break;
+            }
+            owner[id] = i;
+            reached[id] = true;
+            used++;
+            id = clusters()[id].next_cluster;
+        }
+        mark_reached(id);
+        if (length == expected && id != CLUSTER_EOF) {
+            if (id < MAX_CLUSTERS) {
+                report("%s: chain continues past its %u bytes into cluster %u", name, file->size, id);
+            } else if (expected > 0) {
+                report("%s: chain ends in 0x%04X instead of EOF", name, id);
+            } else {
+                report("%s: empty file has first cluster 0x%04X", name, id);
+            }
+        }
+    }
+
+    // Clusters no chain reaches must be free, or they are lost for good.
+    static uint16_t leaked[MAX_CLUSTERS];
+    uint32_t leaks = 0;
+    for (uint32_t id = 0; id < MAX_CLUSTERS; id++) {
+        if (!reached[id] && clusters()[id].next_cluster != CLUSTER_FREE) {
+            leaked[leaks++] = id;
+        }
+    }
+    if (leaks > 0) {
+        fprintf(out, "%u leaked cluster(s):", leaks);
+        print_runs(leaked, leaks);
+        fputc('\n', out);
+        problems++;
+    }
+    if (fat->free_count != MAX_CLUSTERS - used) {
+        report("free_count is %u, chains use %u of %u clusters so it should be %u",
+               fat->free_count, used, MAX_CLUSTERS, MAX_CLUSTERS - used);
+    }
+
+    fprintf(out, "%u file(s), %u cluster(s) used, %u free, %d problem(s)\n", files, used, MAX_CLUSTERS - used, problems);
+    return problems > 0;
+}
+
+static int usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-v] mkfs IMAGE [FILE...] | add IMAGE FILE... | ls IMAGE |\n"
+                    "       get IMAGE NAME.EXT [OUT] | extract IMAGE DIR | dump IMAGE | fsck IMAGE\n", prog);
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    const char *prog = argv[0];
+    bool verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+    argv += verbose;
+    argc -= verbose;
+    if (argc < 3) {
+        return usage(prog);
+    }
+    const char *cmd = argv[1], *path = argv[2];
+
+    // The filesystem reports every step on stdout; keep stdout for our own output.
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    freopen(verbose ? "/dev/stderr" : "/dev/null", "w", stdout);
+
+    int status;
+    if (strcmp(cmd, "mkfs") == 0) {
+        if (open_image(path, IMAGE_CREATE) != 0) {
+            return 1;
+        }
+        mount();
+        fs_init();
+        fat_init();
+        status = add_files(mount(), argc - 3, argv + 3);
+    } else if (strcmp(cmd, "add") == 0 && argc > 3) {
+        if (open_image(path, IMAGE_WRITE) != 0) {
+            return 1;
+        }
+        status = add_files(mount(), argc - 3, argv + 3);
+    } else if (strcmp(cmd, "ls") == 0) {
+        if (open_image(path, IMAGE_READ) != 0) {
+            return 1;
+        }
+        FATable *fat = mount();
+        int count = fs_list(NULL, print_entry, NULL);
+        fprintf(out, "%d file(s), %u free clusters\n", count, fat->free_count);
+        status = 0;
+    } else if (strcmp(cmd, "get") == 0 && argc > 3) {
+        if (open_image(path, IMAGE_READ) != 0) {
+            return 1;
+        }
+        const FS_FILE *file = find_file(mount(), argv[3]);
+        if (file == NULL) {
+            fprintf(stderr, "Error: %s is not in the image\n", argv[3]);
+            status = 1;
+        } else {
+            status = get_file(file, argc > 4 ? argv[4] : argv[3]) != 0;
+        }
+    } else if (strcmp(cmd, "extract") == 0 && argc > 3) {
+        if (open_image(path, IMAGE_READ) != 0) {
+            return 1;
+        }
+        status = extract_all(mount(), argv[3]);
+    } else if (strcmp(cmd, "dump") == 0 || strcmp(cmd, "fsck") == 0) {
+        if (open_image(path, IMAGE_READ) != 0) {
+            return 1;
+        }
+        static FATable table;   // Straight from the image, not through fs_mount.
+        memcpy(&table, image, sizeof(table));
+        status = cmd[0] == 'd' ? dump(&table) : fsck(&table);
+    } else {
+        return usage(prog);
+    }
+
+    close_image();
+    fflush(out);
+    return status;
+}
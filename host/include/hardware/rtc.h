@@ -0,0 +1,11 @@
+#ifndef HOST_HARDWARE_RTC_H
+#define HOST_HARDWARE_RTC_H
+
+#include <stdbool.h>
+#include "pico/util/datetime.h"
+
+void rtc_init(void);
+bool rtc_set_datetime(datetime_t *t);
+bool rtc_get_datetime(datetime_t *t);
+
+#endif // HOST_HARDWARE_RTC_H
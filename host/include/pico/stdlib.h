@@ -0,0 +1,8 @@
+#ifndef HOST_PICO_STDLIB_H
+#define HOST_PICO_STDLIB_H
+
+// Host stand-in for the Pico SDK header so filesystem.c builds on Linux.
+#include <stdint.h>
+#include <stdbool.h>
+
+#endif // HOST_PICO_STDLIB_H
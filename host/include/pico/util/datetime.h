@@ -0,0 +1,17 @@
+#ifndef HOST_PICO_UTIL_DATETIME_H
+#define HOST_PICO_UTIL_DATETIME_H
+
+#include <stdint.h>
+
+// Same layout as the Pico SDK datetime_t, so images are interchangeable with the board.
+typedef struct {
+    int16_t year;    // 0..4095
+    int8_t month;    // 1..12
+    int8_t day;      // 1..31
+    int8_t dotw;     // 0..6, 0 is Sunday
+    int8_t hour;     // 0..23
+    int8_t min;      // 0..59
+    int8_t sec;      // 0..59
+} datetime_t;
+
+#endif // HOST_PICO_UTIL_DATETIME_H
@@ -0,0 +1,37 @@
+#include "hardware/rtc.h"
+#include <stdbool.h>
+#include <time.h>
+
+// Host RTC: reports the local wall clock until rtc_set_datetime pins it to a fixed time,
+// which lets tools stamp files with a chosen date.
+
+static bool rtc_pinned = false;
+static datetime_t rtc_pinned_time;
+
+void rtc_init(void) {
+}
+
+bool rtc_set_datetime(datetime_t *t) {
+    rtc_pinned_time = *t;
+    rtc_pinned = true;
+    return true;
+}
+
+bool rtc_get_datetime(datetime_t *t) {
+    if (rtc_pinned) {
+        *t = rtc_pinned_time;
+        return true;
+    }
+
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    t->year = tm.tm_year + 1900;
+    t->month = tm.tm_mon + 1;
+    t->day = tm.tm_mday;
+    t->dotw = tm.tm_wday;
+    t->hour = tm.tm_hour;
+    t->min = tm.tm_min;
+    t->sec = tm.tm_sec;
+    return true;
+}
@@ -3,13 +3,21 @@
 #include "hardware/gpio.h"
 #include "flash_ops.h"
 #include "filesystem.h"
+#include "fs_export.h"
 #include "hardware/rtc.h"
 #include "pico/stdlib.h"
 #include "pico/util/datetime.h"
 
 
+static FATable *mounted;  // Set by test_fat_read.
+
 int main() {
     run_tests();
+
+    // Hand the USB port to fs_recv for bulk downloads.
+    if (mounted != NULL) {
+        fs_export_serve_usb(mounted);
+    }
     return 0;
 }
 
@@ -34,15 +42,43 @@ void test_usb_connection() {
     }
     printf("USB connection established.\n");
 }
+
+#ifdef FS_STATIC_MEMORY
+// All of the filesystem's RAM. Its size is checked against FS_RAM_BUDGET when filesystem.c
+// is compiled and shows up as a single symbol in the map file.
+static uint8_t fs_arena[FS_ARENA_SIZE(FS_CACHE_SLOTS)] __attribute__((aligned(8)));
+#endif
+
 void test_fat_init() {
+#ifdef FS_STATIC_MEMORY
+    // Nothing works before the arena is mounted. Only format blank or foreign flash;
+    // test_fat_read mounts again afterwards.
+    FATable *fat = fs_mount_arena(fs_arena, sizeof(fs_arena));
+    if (fat == NULL) {
+        printf("Error: Could not mount the filesystem arena.\n");
+        return;
+    }
+    if (fat->free_count <= MAX_CLUSTERS) {
+        printf("FAT already initialized, %u free clusters.\n", fat->free_count);
+        return;
+    }
+    fs_init();
+#endif
     fat_init();
     printf("FAT initialized successfully.\n");
 }
 
 void test_fat_read() {
-    FATable fat;
-    fat_read(&fat);
-    printf("Read FAT. Free clusters available: %u\n", fat.free_count);
+#ifdef FS_STATIC_MEMORY
+    FATable *fat = fs_mount_arena(fs_arena, sizeof(fs_arena));
+#else
+    static FATable fat_storage;  // Far too big for the 2 KB main stack.
+    FATable *fat = &fat_storage;
+    fat_read(fat);
+    fs_mount(fat);
+#endif
+    mounted = fat;
+    printf("Read FAT. Free clusters available: %u\n", fat->free_count);
 }
 
 void test_fs_write_and_read() {